@@ -3,22 +3,48 @@
 #include <linux/slab.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/rhashtable.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
 
 #define NAME_LEN 20
 
 static LIST_HEAD(head_node);
 static DEFINE_MUTEX(list_mtx);
+static struct rhashtable id_index;	/* the same identities, by id */
 
 struct identity {
 	struct list_head list;
+	struct rhash_head hnode;
+	struct kref ref;		/* one for the store, one per finder */
+	struct rcu_head rcu;
 	char name[NAME_LEN];
 	int  id;
 	bool busy;
 };
 
+static const struct rhashtable_params id_params = {
+	.key_len = sizeof(int),
+	.key_offset = offsetof(struct identity, id),
+	.head_offset = offsetof(struct identity, hnode),
+	.automatic_shrinking = true,
+};
+
+/* The last reference is gone; readers may still be looking, free it after them. */
+static void identity_release(struct kref *ref)
+{
+	kfree_rcu(container_of(ref, struct identity, ref), rcu);
+}
+
+static void identity_put(struct identity *idnt)
+{
+	kref_put(&idnt->ref, identity_release);
+}
+
 static int identity_create(char *name, int id)
 {
 	struct identity *tmp = NULL;
+	int ret;
 
 	tmp = kzalloc(sizeof(struct identity), GFP_KERNEL);
 	if (unlikely(!tmp))
@@ -27,49 +53,58 @@ static int identity_create(char *name, int id)
 	strscpy(tmp->name, name, NAME_LEN - 1);
 	tmp->id = id;
 	tmp->busy = false;
+	kref_init(&tmp->ref);
 
+	/* The list keeps the order, the index finds by id. */
 	mutex_lock(&list_mtx);
-	list_add_tail(&tmp->list, &head_node);
+	ret = rhashtable_lookup_insert_fast(&id_index, &tmp->hnode, id_params);
+	if (!ret) {
+		list_add_tail(&tmp->list, &head_node);
+		pr_info("Added node %s to the list\n", tmp->name);
+	}
 	mutex_unlock(&list_mtx);
 
-	pr_info("Added node %s to the list\n", tmp->name);
+	if (ret) {
+		pr_debug("Could not add %d: %d\n", id, ret);
+		kfree(tmp);
+		return ret;
+	}
 
 	return 0;
 }
 
+/*
+ * Lock-free: lookups only take a reference, which the caller drops with
+ * identity_put(). One being destroyed meanwhile is not found.
+ */
 static struct identity *identity_find(int id)
 {
-	struct identity *curr, *found = NULL;
+	struct identity *found;
 
-	mutex_lock(&list_mtx);
-	list_for_each_entry(curr, &head_node, list) {
-		if (curr->id == id) {
-			found = curr;
-			break;
-		}
-	}
-	mutex_unlock(&list_mtx);
+	rcu_read_lock();
+	found = rhashtable_lookup(&id_index, &id, id_params);
+	if (found && !kref_get_unless_zero(&found->ref))
+		found = NULL;
+	rcu_read_unlock();
 
 	return found;
 }
 
 static void identity_destroy(int id)
 {
-	struct identity *curr, *tmp, *found = NULL;
+	struct identity *found;
 
 	mutex_lock(&list_mtx);
-	list_for_each_entry_safe(curr, tmp, &head_node, list) {
-		if (curr->id == id) {
-			found = curr;
-			list_del(&curr->list);
-			break;
-		}
+	found = rhashtable_lookup_fast(&id_index, &id, id_params);
+	if (found) {
+		rhashtable_remove_fast(&id_index, &found->hnode, id_params);
+		list_del(&found->list);
 	}
 	mutex_unlock(&list_mtx);
 
 	if (found) {
 		pr_debug("Destroyed %d\n", found->id);
-		kfree(found);
+		identity_put(found);
 	} else {
 		pr_debug("Tried to destroy %d but not found\n", id);
 	}
@@ -81,8 +116,9 @@ static void list_destroy(void)
 
 	mutex_lock(&list_mtx);
 	list_for_each_entry_safe(curr, tmp, &head_node, list) {
+		rhashtable_remove_fast(&id_index, &curr->hnode, id_params);
 		list_del(&curr->list);
-		kfree(curr);
+		identity_put(curr);
 	}
 	mutex_unlock(&list_mtx);
 }
@@ -91,6 +127,10 @@ static int __init list_init(void)
 {
 	pr_info("list module loaded!\n");
 
+	int ret = rhashtable_init(&id_index, &id_params);
+	if (ret)
+		return ret;
+
 	struct identity *temp;
 
 	identity_create("Alice", 1);
@@ -99,10 +139,12 @@ static int __init list_init(void)
 	identity_create("Gena", 10);
 
 	temp = identity_find(3);
-	if (unlikely(temp == NULL))
+	if (unlikely(temp == NULL)) {
 		pr_debug("id 3 not found\n");
-	else
+	} else {
 		pr_debug("id 3 = %s\n", temp->name);
+		identity_put(temp);
+	}
 
 	temp = identity_find(42);
 	if (likely(temp == NULL))
@@ -120,6 +162,7 @@ static int __init list_init(void)
 static void __exit list_exit(void)
 {
 	list_destroy();
+	rhashtable_destroy(&id_index);
 
 	if (list_empty(&head_node))
 		pr_info("list is empty now\n");
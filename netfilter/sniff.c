@@ -2,56 +2,1322 @@
 #include <linux/module.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
 #include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/tcp.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/string_helpers.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/net.h>
+#include <linux/capability.h>
+#include <linux/jiffies.h>
+#include <linux/wait_bit.h>
+#include <net/dst.h>
+
+#include "sniff.h"
+#include "sniff_xdp.h"
+
+#define SNIFF_RULES_TEXT_MAX	(1 << 20)	/* one write to the patterns file */
+#define SNIFF_SAMPLE_RATE_MAX	1024		/* 1 in N under sustained overload */
 
 static char *search_str = "example";
 module_param(search_str, charp, 0);
-MODULE_PARM_DESC(search_str, "String to search for in packet payload");
+MODULE_PARM_DESC(search_str, "Initial pattern to search for in packet payload");
+
+static char *hook = "prerouting";
+module_param(hook, charp, 0);
+MODULE_PARM_DESC(hook, "Default hook point: prerouting, input or forward");
+
+static int priority = NF_IP_PRI_FIRST;
+module_param(priority, int, 0);
+MODULE_PARM_DESC(priority, "Default hook priority (default=INT_MIN, first)");
+
+static const char * const sniff_hook_names[] = {
+	[NF_INET_PRE_ROUTING] = "prerouting",
+	[NF_INET_LOCAL_IN] = "input",
+	[NF_INET_FORWARD] = "forward",
+};
+
+/*
+ * Per-CPU counters: the hook only ever touches its own CPU's copy, readers
+ * add them up. Nothing on the packet path takes a lock or prints.
+ */
+struct sniff_stats {
+	u64_stats_t packets;	/* seen by the hook */
+	u64_stats_t scanned;	/* payloads scanned */
+	u64_stats_t bytes;	/* payload bytes scanned */
+	u64_stats_t matched;	/* payloads with at least one match */
+	u64_stats_t skipped;	/* not inspected: not TCP/UDP, fragment, no payload, no rules */
+	u64_stats_t truncated;	/* transport header could not be read */
+	u64_stats_t cached;	/* not scanned, flow verdict already known */
+	u64_stats_t untracked;	/* scanned without flow state, table full */
+	u64_stats_t filtered;	/* not scanned, source or port not selected */
+	u64_stats_t shed;	/* not scanned, CPU over its scan budget */
+	u64_stats_t shed_bytes;	/* payload bytes not scanned because of that */
+	u64_stats_t queued;	/* handed to a ring worker, async mode */
+	u64_stats_t dropped;	/* not scanned, ring full, async mode */
+	u64_stats_t behind;	/* TCP segment before the stream, scanned on its own */
+	u64_stats_t reordered;	/* TCP segment not following on, scan state reset */
+	u64_stats_t xdp_skipped;	/* not inspected, XDP program said so */
+	struct u64_stats_sync syncp;
+};
+
+/*
+ * Everything a network namespace owns: its pattern set, counters and hooks.
+ * The hooks are only registered while the namespace has patterns loaded,
+ * so a namespace nobody inspects costs nothing per packet.
+ */
+struct sniff_net {
+	struct net *net;
+	u64 cookie;				/* flow table key, never reused */
+	struct sniff_rules __rcu *rules;	/* NULL when empty */
+	struct sniff_filter __rcu *filter;	/* NULL lets everything through */
+	struct sniff_stats __percpu *stats;
+	struct mutex mtx;			/* rules, hook config and registration */
+	struct nf_hook_ops ops[2];		/* IPv4, IPv6 */
+	bool hooked;
+	struct proc_dir_entry *proc_dir;
+	atomic_t inflight;			/* packets queued for the ring workers */
+	struct mutex bench_mtx;			/* one benchmark at a time */
+	struct sniff_bench *bench;		/* last run, NULL if none */
+};
+
+static unsigned int sniff_net_id __read_mostly;
+
+/* Tells apart the automatons flows may hold a state of; 0 is never used */
+static atomic_t sniff_rules_gen = ATOMIC_INIT(0);
+
+/* A queued packet is done with @sn; the namespace exit waits for the last. */
+static void sniff_net_put(struct sniff_net *sn)
+{
+	if (atomic_dec_and_test(&sn->inflight))
+		wake_up_var(&sn->inflight);
+}
+
+#define sniff_stats_inc(sn, field)					\
+do {									\
+	struct sniff_stats *__s = this_cpu_ptr((sn)->stats);		\
+									\
+	u64_stats_update_begin(&__s->syncp);				\
+	u64_stats_inc(&__s->field);					\
+	u64_stats_update_end(&__s->syncp);				\
+} while (0)
+
+static bool log_matches;
+module_param(log_matches, bool, 0644);
+MODULE_PARM_DESC(log_matches, "Log matching packets, ratelimited (default=0)");
+
+static bool prefilter_bench;
+module_param(prefilter_bench, bool, 0);
+MODULE_PARM_DESC(prefilter_bench, "Print scalar/SIMD prefilter bytes/cycle at load (default=0)");
+
+static bool async_inspect;
+module_param(async_inspect, bool, 0644);
+MODULE_PARM_DESC(async_inspect, "Scan payloads in per-CPU worker threads, not in the hook (default=0)");
+
+static bool xdp_meta;
+module_param(xdp_meta, bool, 0644);
+MODULE_PARM_DESC(xdp_meta, "Skip packets xdp/sniff_xdp.bpf.o tagged uninteresting (default=0)");
+
+static unsigned int flow_budget = 16384;
+module_param(flow_budget, uint, 0644);
+MODULE_PARM_DESC(flow_budget, "Payload bytes scanned per flow, 0 for all (default=16384)");
+
+static unsigned int cpu_budget;
+module_param(cpu_budget, uint, 0644);
+MODULE_PARM_DESC(cpu_budget, "Payload bytes scanned per CPU per jiffy before sampling, 0 for no limit (default=0)");
+
+static unsigned int sample_rate = 8;
+module_param(sample_rate, uint, 0644);
+MODULE_PARM_DESC(sample_rate, "Scan 1 in N payloads on a CPU over budget, N doubles while it stays over (default=8)");
+
+/*
+ * Scan budget. It is per CPU, not per namespace: what has to be bounded is
+ * the softirq time spent scanning on a CPU, whoever the packets belong to.
+ * Within a jiffy payloads are scanned freely until the budget is used up,
+ * then only 1 in rate. Every jiffy that ends over budget doubles rate,
+ * every one that does not halves it, so sampling backs off as fast as the
+ * overload goes away.
+ */
+struct sniff_cpu_budget {
+	unsigned long stamp;	/* jiffy used is counted for */
+	unsigned int used;	/* payload bytes scanned in it */
+	unsigned int rate;	/* 0 while not sampling */
+	unsigned int seq;
+};
+
+static DEFINE_PER_CPU(struct sniff_cpu_budget, sniff_budget);
+
+static bool sniff_budget_admit(void)
+{
+	struct sniff_cpu_budget *b = this_cpu_ptr(&sniff_budget);
+	unsigned int limit = READ_ONCE(cpu_budget);
+	unsigned int min_rate = clamp_val(READ_ONCE(sample_rate), 2, SNIFF_SAMPLE_RATE_MAX);
+	unsigned long now = jiffies;
+
+	if (!limit) {
+		if (b->rate)
+			WRITE_ONCE(b->rate, 0);
+		return true;
+	}
+
+	if (b->stamp != now) {
+		unsigned int rate;
+
+		// only a jiffy straight after one over budget counts as overload
+		if (b->used >= limit && now - b->stamp == 1)
+			rate = clamp_val(b->rate * 2, min_rate, SNIFF_SAMPLE_RATE_MAX);
+		else if (b->rate / 2 >= min_rate)
+			rate = b->rate / 2;
+		else
+			rate = 0;
+
+		b->stamp = now;
+		WRITE_ONCE(b->used, 0);
+		WRITE_ONCE(b->rate, rate);
+	}
+
+	if (b->used < limit)
+		return true;
+	return ++b->seq % (b->rate ?: min_rate) == 0;
+}
+
+static void sniff_budget_charge(unsigned int bytes)
+{
+	struct sniff_cpu_budget *b = this_cpu_ptr(&sniff_budget);
+
+	WRITE_ONCE(b->used, b->used + bytes);
+}
+
+static void sniff_stats_shed(struct sniff_net *sn, unsigned int bytes)
+{
+	struct sniff_stats *s = this_cpu_ptr(sn->stats);
+
+	u64_stats_update_begin(&s->syncp);
+	u64_stats_inc(&s->shed);
+	u64_stats_add(&s->shed_bytes, bytes);
+	u64_stats_update_end(&s->syncp);
+}
+
+static void sniff_stats_scanned(struct sniff_net *sn, unsigned int bytes, bool matched)
+{
+	struct sniff_stats *s = this_cpu_ptr(sn->stats);
+
+	u64_stats_update_begin(&s->syncp);
+	u64_stats_inc(&s->scanned);
+	u64_stats_add(&s->bytes, bytes);
+	if (matched)
+		u64_stats_inc(&s->matched);
+	u64_stats_update_end(&s->syncp);
+}
+
+static void sniff_rules_free(struct sniff_rules *rules)
+{
+	if (!rules)
+		return;
+
+	free_percpu(rules->hits);
+	sniff_ac_free(rules->ac);
+	kvfree(rules->len);
+	kvfree(rules->pat);
+	kvfree(rules);
+}
+
+/*
+ * Parse a pattern set: one pattern per line, C-style escapes (\xNN, \n, ...)
+ * allowed, empty lines and lines starting with '#' ignored.
+ * @text is NUL-terminated and modified in place.
+ */
+static struct sniff_rules *sniff_rules_parse(char *text, size_t size)
+{
+	struct sniff_rules *rules;
+	unsigned int nlines = 1;
+	u8 *dst;
+	char *line;
+	int ret;
+
+	for (line = text; *line; line++)
+		if (*line == '\n')
+			nlines++;
+
+	rules = kvzalloc(struct_size(rules, blob, size + 1), GFP_KERNEL);
+	if (!rules)
+		return ERR_PTR(-ENOMEM);
+	rules->len = kvmalloc_array(nlines, sizeof(*rules->len), GFP_KERNEL);
+	rules->pat = kvmalloc_array(nlines, sizeof(*rules->pat), GFP_KERNEL);
+	if (!rules->len || !rules->pat) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	dst = rules->blob;
+	while ((line = strsep(&text, "\n")) != NULL) {
+		int len;
+
+		strim(line);
+		if (!*line || *line == '#')
+			continue;
+
+		len = string_unescape(line, dst, strlen(line) + 1, UNESCAPE_ANY);
+		if (len <= 0)
+			continue;
+
+		rules->pat[rules->npatterns] = dst;
+		rules->len[rules->npatterns] = len;
+		rules->npatterns++;
+		dst += len;
+	}
+
+	if (!rules->npatterns) {
+		sniff_rules_free(rules);
+		return NULL;
+	}
+
+	rules->ac = sniff_ac_build(rules->pat, rules->len, rules->npatterns);
+	if (IS_ERR(rules->ac)) {
+		ret = PTR_ERR(rules->ac);
+		rules->ac = NULL;
+		goto err;
+	}
+
+	do {
+		rules->gen = atomic_inc_return(&sniff_rules_gen);
+	} while (!(u16)rules->gen);
+
+	rules->hits = __alloc_percpu(array_size(rules->npatterns, sizeof(u64)),
+				     __alignof__(u64));
+	if (!rules->hits) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	return rules;
+
+err:
+	sniff_rules_free(rules);
+	return ERR_PTR(ret);
+}
+
+/* Register or drop the hooks of @sn; called with sn->mtx held. */
+static int sniff_net_hook(struct sniff_net *sn, bool on)
+{
+	int ret = 0;
+
+	lockdep_assert_held(&sn->mtx);
+
+	if (on && !sn->hooked)
+		ret = nf_register_net_hooks(sn->net, sn->ops, ARRAY_SIZE(sn->ops));
+	else if (!on && sn->hooked)
+		nf_unregister_net_hooks(sn->net, sn->ops, ARRAY_SIZE(sn->ops));
+
+	if (!ret)
+		sn->hooked = on;
+	return ret;
+}
+
+/*
+ * Swap in a new pattern set. The hook only ever dereferences the pointer
+ * under RCU, so it never waits for a reload; the old set is freed once
+ * every CPU is done with it. Loading the first patterns hooks the
+ * namespace, loading an empty set unhooks it.
+ */
+static int sniff_rules_publish(struct sniff_net *sn, struct sniff_rules *rules)
+{
+	struct sniff_rules *old;
+	int ret;
+
+	mutex_lock(&sn->mtx);
+	old = rcu_replace_pointer(sn->rules, rules, lockdep_is_held(&sn->mtx));
+	ret = sniff_net_hook(sn, rules != NULL);
+	if (ret) {
+		// keep the old set, which matches the hook state
+		rcu_assign_pointer(sn->rules, old);
+		old = rules;
+	}
+	mutex_unlock(&sn->mtx);
+
+	if (!ret)
+		pr_info("loaded %u patterns\n", rules ? rules->npatterns : 0);
+
+	synchronize_rcu();
+	sniff_rules_free(old);
+
+	return ret;
+}
+
+static int sniff_patterns_show(struct seq_file *m, void *v)
+{
+	struct sniff_net *sn = m->private;
+	struct sniff_rules *rules;
+
+	rcu_read_lock();
+	rules = rcu_dereference(sn->rules);
+	for (unsigned int i = 0; rules && i < rules->npatterns; i++) {
+		seq_printf(m, "%u\t", i);
+		for (unsigned int j = 0; j < rules->len[i]; j++) {
+			u8 c = rules->pat[i][j];
+
+			if (isprint(c) && c != '\\')
+				seq_putc(m, c);
+			else
+				seq_printf(m, "\\x%02x", c);
+		}
+		seq_putc(m, '\n');
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static int sniff_patterns_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sniff_patterns_show, pde_data(inode));
+}
+
+/* NUL-terminated copy of a whole configuration write */
+static char *sniff_copy_text(const char __user *ubuf, size_t count)
+{
+	char *text;
+
+	if (count > SNIFF_RULES_TEXT_MAX)
+		return ERR_PTR(-E2BIG);
+
+	text = kvmalloc(count + 1, GFP_KERNEL);
+	if (!text)
+		return ERR_PTR(-ENOMEM);
+
+	if (copy_from_user(text, ubuf, count)) {
+		kvfree(text);
+		return ERR_PTR(-EFAULT);
+	}
+	text[count] = '\0';
+
+	return text;
+}
+
+/* Each write replaces the whole pattern set. */
+static ssize_t sniff_patterns_write(struct file *file, const char __user *ubuf,
+				    size_t count, loff_t *ppos)
+{
+	struct sniff_net *sn = pde_data(file_inode(file));
+	struct sniff_rules *rules;
+	char *text;
+	int ret;
+
+	if (!ns_capable(sn->net->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
+
+	text = sniff_copy_text(ubuf, count);
+	if (IS_ERR(text))
+		return PTR_ERR(text);
+
+	rules = sniff_rules_parse(text, count);
+	kvfree(text);
+	if (IS_ERR(rules))
+		return PTR_ERR(rules);
+
+	ret = sniff_rules_publish(sn, rules);
+
+	return ret ? ret : count;
+}
+
+static const struct proc_ops sniff_patterns_ops = {
+	.proc_open = sniff_patterns_open,
+	.proc_read = seq_read,
+	.proc_write = sniff_patterns_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+static int sniff_filter_show_net(struct seq_file *m, void *v)
+{
+	struct sniff_net *sn = m->private;
+	struct sniff_filter *f;
+
+	rcu_read_lock();
+	f = rcu_dereference(sn->filter);
+	if (f)
+		sniff_filter_show(m, f);
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static int sniff_filter_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sniff_filter_show_net, pde_data(inode));
+}
+
+/* Each write replaces the whole filter; an empty one selects everything. */
+static ssize_t sniff_filter_write(struct file *file, const char __user *ubuf,
+				  size_t count, loff_t *ppos)
+{
+	struct sniff_net *sn = pde_data(file_inode(file));
+	struct sniff_filter *f, *old;
+	char *text;
+
+	if (!ns_capable(sn->net->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
 
-static struct nf_hook_ops nfho;
+	text = sniff_copy_text(ubuf, count);
+	if (IS_ERR(text))
+		return PTR_ERR(text);
+
+	f = sniff_filter_parse(text);
+	kvfree(text);
+	if (IS_ERR(f))
+		return PTR_ERR(f);
+
+	mutex_lock(&sn->mtx);
+	old = rcu_replace_pointer(sn->filter, f, lockdep_is_held(&sn->mtx));
+	mutex_unlock(&sn->mtx);
+
+	synchronize_rcu();
+	sniff_filter_free(old);
+
+	return count;
+}
+
+static const struct proc_ops sniff_filter_ops = {
+	.proc_open = sniff_filter_open,
+	.proc_read = seq_read,
+	.proc_write = sniff_filter_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+static int sniff_hook_show(struct seq_file *m, void *v)
+{
+	struct sniff_net *sn = m->private;
+
+	mutex_lock(&sn->mtx);
+	seq_printf(m, "%s %d%s\n", sniff_hook_names[sn->ops[0].hooknum],
+		   sn->ops[0].priority, sn->hooked ? "" : " (inactive)");
+	mutex_unlock(&sn->mtx);
+
+	return 0;
+}
+
+static int sniff_hook_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sniff_hook_show, pde_data(inode));
+}
+
+static int sniff_hook_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sniff_hook_names); i++)
+		if (sniff_hook_names[i] && sysfs_streq(name, sniff_hook_names[i]))
+			return i;
+	return -EINVAL;
+}
+
+static void sniff_net_set_hook(struct sniff_net *sn, int hooknum, int prio)
+{
+	for (int i = 0; i < ARRAY_SIZE(sn->ops); i++) {
+		sn->ops[i].hooknum = hooknum;
+		sn->ops[i].priority = prio;
+	}
+}
+
+/* "<prerouting|input|forward> [priority]"; moves live hooks right away. */
+static ssize_t sniff_hook_write(struct file *file, const char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	struct sniff_net *sn = pde_data(file_inode(file));
+	char buf[64], name[16];
+	int hooknum, prio, old_hooknum, old_prio, n, ret = 0;
+	bool hooked;
+
+	if (!ns_capable(sn->net->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	n = sscanf(buf, "%15s %d", name, &prio);
+	if (n < 1)
+		return -EINVAL;
+	hooknum = sniff_hook_parse(name);
+	if (hooknum < 0)
+		return hooknum;
+
+	mutex_lock(&sn->mtx);
+	if (n < 2)
+		prio = sn->ops[0].priority;
+
+	hooked = sn->hooked;
+	old_hooknum = sn->ops[0].hooknum;
+	old_prio = sn->ops[0].priority;
+	sniff_net_hook(sn, false);
+	sniff_net_set_hook(sn, hooknum, prio);
+	if (hooked) {
+		ret = sniff_net_hook(sn, true);
+		if (ret) {
+			// go on inspecting where we were; the hook file shows
+			// "(inactive)" should even that fail
+			sniff_net_set_hook(sn, old_hooknum, old_prio);
+			if (sniff_net_hook(sn, true))
+				pr_warn("hooks lost after a failed move\n");
+		}
+	}
+	mutex_unlock(&sn->mtx);
+
+	return ret ? ret : count;
+}
+
+static const struct proc_ops sniff_hook_ops = {
+	.proc_open = sniff_hook_open,
+	.proc_read = seq_read,
+	.proc_write = sniff_hook_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+static int sniff_stats_show(struct seq_file *m, void *v)
+{
+	u64 packets = 0, scanned = 0, bytes = 0, matched = 0, skipped = 0, truncated = 0;
+	u64 cached = 0, untracked = 0, filtered = 0, shed = 0, shed_bytes = 0;
+	u64 queued = 0, dropped = 0, behind = 0, reordered = 0, xdp_skipped = 0;
+	unsigned int sampling = 0, rate_max = 0;
+	struct sniff_net *sn = m->private;
+	struct sniff_rules *rules;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		const struct sniff_stats *s = per_cpu_ptr(sn->stats, cpu);
+		u64 p, sc, b, ma, sk, t, c, u, f, sh, shb, q, d, be, ro, x;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin(&s->syncp);
+			p = u64_stats_read(&s->packets);
+			sc = u64_stats_read(&s->scanned);
+			b = u64_stats_read(&s->bytes);
+			ma = u64_stats_read(&s->matched);
+			sk = u64_stats_read(&s->skipped);
+			t = u64_stats_read(&s->truncated);
+			c = u64_stats_read(&s->cached);
+			u = u64_stats_read(&s->untracked);
+			f = u64_stats_read(&s->filtered);
+			sh = u64_stats_read(&s->shed);
+			shb = u64_stats_read(&s->shed_bytes);
+			q = u64_stats_read(&s->queued);
+			d = u64_stats_read(&s->dropped);
+			be = u64_stats_read(&s->behind);
+			ro = u64_stats_read(&s->reordered);
+			x = u64_stats_read(&s->xdp_skipped);
+		} while (u64_stats_fetch_retry(&s->syncp, start));
+
+		packets += p;
+		scanned += sc;
+		bytes += b;
+		matched += ma;
+		skipped += sk;
+		truncated += t;
+		cached += c;
+		untracked += u;
+		filtered += f;
+		shed += sh;
+		shed_bytes += shb;
+		queued += q;
+		dropped += d;
+		behind += be;
+		reordered += ro;
+		xdp_skipped += x;
+	}
+
+	for_each_online_cpu(cpu) {
+		unsigned int rate = READ_ONCE(per_cpu_ptr(&sniff_budget, cpu)->rate);
+
+		if (rate) {
+			sampling++;
+			rate_max = max(rate_max, rate);
+		}
+	}
+
+	seq_printf(m, "packets %llu\nscanned %llu\nbytes %llu\nmatched %llu\n"
+		   "skipped %llu\ntruncated %llu\ncached %llu\nuntracked %llu\nfiltered %llu\n"
+		   "shed %llu\nshed_bytes %llu\nqueued %llu\ndropped %llu\nbehind %llu\n"
+		   "reordered %llu\nxdp_skipped %llu\nflows %u\n",
+		   packets, scanned, bytes, matched, skipped, truncated, cached, untracked,
+		   filtered, shed, shed_bytes, queued, dropped, behind, reordered,
+		   xdp_skipped, sniff_flow_count());
+
+	// budget state is per CPU and shared by all namespaces
+	seq_printf(m, "cpu_budget %u\nsampling_cpus %u\nsample_rate_max %u\n",
+		   READ_ONCE(cpu_budget), sampling, rate_max);
+
+	// per pattern hits, reset whenever the set is reloaded
+	rcu_read_lock();
+	rules = rcu_dereference(sn->rules);
+	for (unsigned int i = 0; rules && i < rules->npatterns; i++) {
+		u64 hits = 0;
+
+		for_each_possible_cpu(cpu)
+			hits += per_cpu_ptr(rules->hits, cpu)[i];
+		seq_printf(m, "pattern %u %llu\n", i, hits);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+/* Async rings are per CPU and shared by all namespaces */
+static int sniff_rings_show(struct seq_file *m, void *v)
+{
+	sniff_async_show(m);
+	return 0;
+}
+
+/* Per-packet scan state */
+struct sniff_scan {
+	const struct sniff_rules *rules;
+	u32 state;		/* automaton state, carried across chunks */
+	unsigned int base;	/* payload offset of the current chunk */
+	unsigned int matches;
+	int pattern;		/* first pattern matched, -1 if none */
+	unsigned int end;	/* payload offset just past that match */
+};
+
+static bool sniff_count_match(unsigned int pattern, unsigned int end, void *arg)
+{
+	struct sniff_scan *scan = arg;
+
+	this_cpu_inc(scan->rules->hits[pattern]);
+	if (!scan->matches++) {
+		scan->pattern = pattern;
+		scan->end = scan->base + end;
+	}
+	return false;
+}
+
+/*
+ * Scan bytes [from, to) of the skb in place. skb_seq_read() hands out the
+ * linear area, each page frag and each frag_list skb in turn, so GRO/GSO
+ * payload is never copied or linearized; the automaton state is carried
+ * from one chunk to the next, so matches across chunk borders are found.
+ */
+static void sniff_scan_skb(struct sniff_scan *scan, struct sk_buff *skb,
+			   unsigned int from, unsigned int to)
+{
+	struct skb_seq_state st;
+	const u8 *data;
+	unsigned int len;
+
+	scan->base = 0;
+	skb_prepare_seq_read(skb, from, to, &st);
+	while ((len = skb_seq_read(scan->base, &data, &st)) != 0) {
+		sniff_ac_scan(scan->rules->ac, &scan->state, data, len,
+			      sniff_count_match, scan);
+		scan->base += len;
+	}
+}
+
+/*
+ * A TCP flow's stream position: the next sequence number expected, the
+ * automaton state there and the low bits of the rules->gen that state
+ * belongs to (0 for none). Segments of one flow can be inspected on two
+ * CPUs at once, across a rules reload, so all three are published in one
+ * word; a state is never paired with another automaton's generation.
+ */
+#define SNIFF_CURSOR(seq, gen, state) \
+	((u64)(seq) << 32 | (u64)(u16)(gen) << 16 | (u16)(state))
+#define SNIFF_CURSOR_SEQ(c)	((u32)((c) >> 32))
+#define SNIFF_CURSOR_GEN(c)	((u16)((c) >> 16))
+#define SNIFF_CURSOR_STATE(c)	((u16)(c))
+
+/*
+ * Where a TCP segment's scan starts: in the automaton state the previous
+ * segment left behind if it follows on from it, past the bytes already
+ * scanned if it overlaps them. After a gap the scan starts over from state
+ * 0, so only a pattern spanning the gap is lost; nothing is ever buffered.
+ * A segment wholly behind the stream, retransmitted or late, is scanned
+ * on its own; false is returned so that it leaves the stream state alone.
+ */
+static bool sniff_stream_resume(struct sniff_net *sn, const struct sniff_rules *rules,
+				const struct sniff_flow *flow, const struct sniff_pkt *pkt,
+				unsigned int *from, unsigned int len, u32 *state)
+{
+	u64 cursor = READ_ONCE(flow->cursor);
+	u32 next = SNIFF_CURSOR_SEQ(cursor);
+
+	*state = 0;
+
+	// a new flow, or state of an automaton that is gone; the generation
+	// is truncated, so a state is also checked against the automaton
+	if (SNIFF_CURSOR_GEN(cursor) != (u16)rules->gen ||
+	    SNIFF_CURSOR_STATE(cursor) >= sniff_ac_states(rules->ac))
+		return true;
+
+	if (pkt->seq == next) {
+		*state = SNIFF_CURSOR_STATE(cursor);
+		return true;
+	}
+
+	if (before(pkt->seq, next)) {
+		// retransmitted, at least partly
+		if (next - pkt->seq >= len) {
+			sniff_stats_inc(sn, behind);
+			return false;
+		}
+		*from += next - pkt->seq;
+		*state = SNIFF_CURSOR_STATE(cursor);
+		return true;
+	}
+
+	// a segment went missing, or is still to come
+	sniff_stats_inc(sn, reordered);
+	return true;
+}
+
+/*
+ * Scan the payload of a classified packet and record the outcome in its
+ * flow. Runs in the hook or, in async mode, in the ring worker; only the
+ * hook is held to the per-CPU scan budget.
+ */
+static void sniff_inspect_payload(struct sniff_net *sn, const struct sniff_rules *rules,
+				  struct sk_buff *skb, const struct sniff_pkt *pkt,
+				  bool inline_scan)
+{
+	const struct sniff_flow_key *key = &pkt->key;
+	unsigned int from = pkt->from, to = skb->len, budget = 0;
+	struct sniff_scan scan;
+	struct sniff_flow *flow;
+	bool stream = false;
+
+	scan.state = 0;
+
+	// a flow that matched or used up its budget is not scanned again
+	flow = sniff_flow_get(key);
+	if (flow) {
+		if (READ_ONCE(flow->verdict) != SNIFF_FLOW_SCAN) {
+			sniff_stats_inc(sn, cached);
+			goto out;
+		}
+		if (pkt->stream)
+			stream = sniff_stream_resume(sn, rules, flow, pkt, &from, to - from,
+						     &scan.state);
+		budget = READ_ONCE(flow_budget);
+		if (budget)
+			to = from + min(to - from, budget - min(budget, flow->scanned));
+	} else {
+		sniff_stats_inc(sn, untracked);
+	}
+
+	// over budget this CPU only scans a sample; the flow keeps its verdict
+	if (inline_scan && !sniff_budget_admit()) {
+		sniff_stats_shed(sn, to - from);
+		goto out;
+	}
+
+	// search for all patterns in one pass
+	scan.rules = rules;
+	scan.matches = 0;
+	scan.pattern = -1;
+	sniff_scan_skb(&scan, skb, from, to);
+
+	if (inline_scan)
+		sniff_budget_charge(to - from);
+	sniff_stats_scanned(sn, to - from, scan.matches != 0);
+	if (scan.matches)
+		sniff_event_emit(skb, pkt, scan.pattern, from - pkt->from + scan.end,
+				 scan.matches);
+	if (scan.matches && log_matches) {
+		if (key->family == NFPROTO_IPV4)
+			net_info_ratelimited("Found pattern %d at offset %u in packet from %pI4\n",
+					     scan.pattern, scan.end, &key->saddr.s6_addr32[3]);
+		else
+			net_info_ratelimited("Found pattern %d at offset %u in packet from %pI6c\n",
+					     scan.pattern, scan.end, &key->saddr);
+	}
+
+	if (flow) {
+		// a segment that was not scanned leaves a gap the next one sees
+		if (stream)
+			WRITE_ONCE(flow->cursor, SNIFF_CURSOR(pkt->seq + (skb->len - pkt->from),
+							      rules->gen, scan.state));
+		WRITE_ONCE(flow->scanned, flow->scanned + (to - from));
+		if (scan.matches)
+			WRITE_ONCE(flow->verdict, SNIFF_FLOW_MATCHED);
+		else if (budget && flow->scanned >= budget)
+			WRITE_ONCE(flow->verdict, SNIFF_FLOW_DONE);
+	}
+out:
+	// the connection is going away, no need to wait for the GC
+	if (flow && pkt->fin)
+		sniff_flow_del(flow);
+}
+
+/*
+ * Async mode: the hook settles packets of flows with a known verdict and
+ * hands the rest, cloned, to this CPU's ring worker. The packet itself goes
+ * on at once, however long the patterns take; when the ring is full it goes
+ * on uninspected.
+ */
+static void sniff_inspect_queue(struct sniff_net *sn, struct sk_buff *skb,
+				const struct sniff_pkt *pkt)
+{
+	struct sniff_flow *flow;
+	struct sk_buff *clone;
+
+	flow = sniff_flow_lookup(&pkt->key);
+	if (flow && READ_ONCE(flow->verdict) != SNIFF_FLOW_SCAN) {
+		sniff_stats_inc(sn, cached);
+		if (pkt->fin)
+			sniff_flow_del(flow);
+		return;
+	}
+
+	clone = skb_clone(skb, GFP_ATOMIC | __GFP_NOWARN);
+	if (!clone) {
+		sniff_stats_inc(sn, dropped);
+		return;
+	}
+	// only the payload is read later, don't pin the route or conntrack entry
+	skb_dst_drop(clone);
+	nf_reset_ct(clone);
+
+	atomic_inc(&sn->inflight);
+	if (!sniff_async_queue(sn, clone, pkt)) {
+		sniff_net_put(sn);
+		kfree_skb(clone);
+		sniff_stats_inc(sn, dropped);
+		return;
+	}
+	sniff_stats_inc(sn, queued);
+}
+
+/* The ring worker's end of sniff_inspect_queue(), BH disabled and under RCU */
+void sniff_async_inspect(void *priv, struct sk_buff *skb, const struct sniff_pkt *pkt)
+{
+	struct sniff_net *sn = priv;
+	struct sniff_rules *rules;
+
+	rules = rcu_dereference(sn->rules);
+	if (rules)
+		sniff_inspect_payload(sn, rules, skb, pkt, false);
+	else
+		sniff_stats_inc(sn, skipped);
+
+	consume_skb(skb);
+	sniff_net_put(sn);
+}
+
+/*
+ * Everything past the network header is shared by both families: @pkt has
+ * the addresses, family and protocol of its key filled in, @thoff is the
+ * offset of the transport header.
+ */
+static void sniff_inspect(struct sniff_net *sn, struct sk_buff *skb,
+			  struct sniff_pkt *pkt, unsigned int thoff)
+{
+	struct sniff_flow_key *key = &pkt->key;
+	union {
+		struct tcphdr tcp;
+		struct udphdr udp;
+	} _hdr;
+	const struct tcphdr *tcp_header = NULL;
+	const struct udphdr *udp_header;
+	struct sniff_filter *filter;
+	struct sniff_rules *rules;
+
+	rules = rcu_dereference(sn->rules);
+	if (!rules) {
+		sniff_stats_inc(sn, skipped);
+		return;
+	}
+
+	// the header itself may already live in a frag
+	switch (key->proto) {
+	case IPPROTO_TCP:
+		tcp_header = skb_header_pointer(skb, thoff, sizeof(_hdr.tcp), &_hdr.tcp);
+		if (!tcp_header) {
+			sniff_stats_inc(sn, truncated);
+			return;
+		}
+		key->sport = tcp_header->source;
+		key->dport = tcp_header->dest;
+		pkt->from = thoff + tcp_header->doff * 4;
+		// a SYN takes up one sequence number ahead of the data
+		pkt->seq = ntohl(tcp_header->seq) + tcp_header->syn;
+		pkt->stream = true;
+		pkt->fin = tcp_header->fin || tcp_header->rst;
+		break;
+	case IPPROTO_UDP:
+		udp_header = skb_header_pointer(skb, thoff, sizeof(_hdr.udp), &_hdr.udp);
+		if (!udp_header) {
+			sniff_stats_inc(sn, truncated);
+			return;
+		}
+		key->sport = udp_header->source;
+		key->dport = udp_header->dest;
+		pkt->from = thoff + sizeof(*udp_header);
+		break;
+	default:
+		sniff_stats_inc(sn, skipped);
+		return;
+	}
+
+	// header-only stage: uninteresting sources and ports stop here
+	filter = rcu_dereference(sn->filter);
+	if (filter && !sniff_filter_match(filter, key)) {
+		sniff_stats_inc(sn, filtered);
+		return;
+	}
+
+	// ip_rcv()/ipv6_rcv() trimmed skb->len to the datagram
+	if (pkt->from >= skb->len) {
+		// a FIN or RST without data still ends the flow
+		if (pkt->fin)
+			sniff_flow_forget(key);
+		sniff_stats_inc(sn, skipped);
+		return;
+	}
+
+	if (READ_ONCE(async_inspect))
+		sniff_inspect_queue(sn, skb, pkt);
+	else
+		sniff_inspect_payload(sn, rules, skb, pkt, true);
+}
+
+/*
+ * Whether the XDP front end already ruled the packet out. The metadata it
+ * wrote sits right in front of the MAC header and is only there if an XDP
+ * program put it there, so nothing else can forge a verdict.
+ */
+static bool sniff_xdp_skip(const struct sk_buff *skb)
+{
+	const struct sniff_xdp_meta *meta;
+
+	if (!READ_ONCE(xdp_meta) || skb_metadata_len(skb) != sizeof(*meta))
+		return false;
+
+	meta = (const void *)skb_metadata_end(skb) - sizeof(*meta);
+	return meta->magic == SNIFF_XDP_MAGIC && meta->verdict == SNIFF_XDP_SKIP;
+}
 
 static unsigned int hook_func(void *priv, struct sk_buff *skb, const struct nf_hook_state *state)
 {
-	struct iphdr *ip_header;
-	struct tcphdr *tcp_header;
-	struct udphdr *udp_header;
-	char *data;
-	unsigned int data_len;
+	struct sniff_net *sn = priv;
+	const struct iphdr *ip_header;
+	struct sniff_pkt pkt;
+
+	sniff_stats_inc(sn, packets);
+
+	if (sniff_xdp_skip(skb)) {
+		sniff_stats_inc(sn, xdp_skipped);
+		return NF_ACCEPT;
+	}
 
 	// check if the packet is IP
 	ip_header = ip_hdr(skb);
 	if (!ip_header)
 		return NF_ACCEPT;
 
-	// if not TCP, 
-	if (ip_header->protocol == IPPROTO_TCP) {
-		tcp_header = tcp_hdr(skb);
-		data = (char *)((unsigned char *)tcp_header + (tcp_header->doff * 4));
-		data_len = ntohs(ip_header->tot_len) - ip_hdrlen(skb) - (tcp_header->doff * 4);
+	// only the first fragment carries the transport header
+	if (ip_header->frag_off & htons(IP_OFFSET)) {
+		sniff_stats_inc(sn, skipped);
+		return NF_ACCEPT;
+	}
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.key.net = sn->cookie;
+	ipv6_addr_set_v4mapped(ip_header->saddr, &pkt.key.saddr);
+	ipv6_addr_set_v4mapped(ip_header->daddr, &pkt.key.daddr);
+	pkt.key.family = NFPROTO_IPV4;
+	pkt.key.proto = ip_header->protocol;
+
+	sniff_inspect(sn, skb, &pkt, skb_network_offset(skb) + ip_hdrlen(skb));
+
+	return NF_ACCEPT;
+}
+
+static unsigned int hook_func_v6(void *priv, struct sk_buff *skb, const struct nf_hook_state *state)
+{
+	struct sniff_net *sn = priv;
+	const struct ipv6hdr *ip6_header;
+	struct sniff_pkt pkt;
+	__be16 frag_off;
+	u8 nexthdr;
+	int thoff;
+
+	sniff_stats_inc(sn, packets);
+
+	if (sniff_xdp_skip(skb)) {
+		sniff_stats_inc(sn, xdp_skipped);
+		return NF_ACCEPT;
+	}
+
+	ip6_header = ipv6_hdr(skb);
+	nexthdr = ip6_header->nexthdr;
 
-		// search for the string
-		if (data_len > 0 && strstr(data, search_str))
-			pr_info("Found %s in packet from %pI4\n", search_str, &ip_header->saddr);
+	// returns at once when TCP/UDP follows the fixed header
+	thoff = ipv6_skip_exthdr(skb, skb_network_offset(skb) + sizeof(*ip6_header),
+				 &nexthdr, &frag_off);
+	if (thoff < 0) {
+		sniff_stats_inc(sn, truncated);
+		return NF_ACCEPT;
+	}
 
-	} else if (ip_header->protocol == IPPROTO_UDP) {
-		udp_header = udp_hdr(skb);
+	// only the first fragment carries the transport header
+	if (frag_off & htons(IP6_OFFSET)) {
+		sniff_stats_inc(sn, skipped);
+		return NF_ACCEPT;
 	}
 
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.key.net = sn->cookie;
+	pkt.key.saddr = ip6_header->saddr;
+	pkt.key.daddr = ip6_header->daddr;
+	pkt.key.family = NFPROTO_IPV6;
+	pkt.key.proto = nexthdr;
+
+	sniff_inspect(sn, skb, &pkt, thoff);
+
 	return NF_ACCEPT;
 }
 
+static int sniff_bench_show_net(struct seq_file *m, void *v)
+{
+	struct sniff_net *sn = m->private;
+
+	mutex_lock(&sn->bench_mtx);
+	if (sn->bench)
+		sniff_bench_show(m, sn->bench);
+	mutex_unlock(&sn->bench_mtx);
+
+	return 0;
+}
+
+static int sniff_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sniff_bench_show_net, pde_data(inode));
+}
+
+/*
+ * Writing a configuration runs the benchmark there and then, through this
+ * namespace's hook with its patterns, filter and counters; matching
+ * packets carry the first pattern. Reading shows the last run.
+ */
+static ssize_t sniff_bench_write(struct file *file, const char __user *ubuf,
+				 size_t count, loff_t *ppos)
+{
+	struct sniff_net *sn = pde_data(file_inode(file));
+	struct sniff_rules *rules;
+	struct sniff_bench *b;
+	u8 *pat = NULL;
+	char *text;
+	int ret;
+
+	if (!ns_capable(sn->net->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
+
+	text = sniff_copy_text(ubuf, count);
+	if (IS_ERR(text))
+		return PTR_ERR(text);
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b) {
+		kvfree(text);
+		return -ENOMEM;
+	}
+
+	ret = sniff_bench_parse(text, b);
+	kvfree(text);
+	if (ret)
+		goto out;
+
+	rcu_read_lock();
+	rules = rcu_dereference(sn->rules);
+	if (rules) {
+		pat = kmemdup(rules->pat[0], rules->len[0], GFP_ATOMIC);
+		b->patlen = rules->len[0];
+	}
+	rcu_read_unlock();
+	if (rules && !pat) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	b->hook = b->family == NFPROTO_IPV4 ? hook_func : hook_func_v6;
+	b->priv = sn;
+	b->cookie = sn->cookie;
+	b->pat = pat;
+
+	mutex_lock(&sn->bench_mtx);
+	ret = sniff_bench_run(b);
+	if (!ret) {
+		b->pat = NULL;
+		swap(sn->bench, b);
+	}
+	mutex_unlock(&sn->bench_mtx);
+
+out:
+	kfree(pat);
+	kfree(b);
+	return ret ?: count;
+}
+
+static const struct proc_ops sniff_bench_ops = {
+	.proc_open = sniff_bench_open,
+	.proc_read = seq_read,
+	.proc_write = sniff_bench_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+static int __net_init sniff_net_init(struct net *net)
+{
+	struct sniff_net *sn = net_generic(net, sniff_net_id);
+	struct sniff_rules *rules = NULL;
+	int hooknum, cpu, ret;
+	char *text;
+
+	sn->net = net;
+	sn->cookie = net->net_cookie;
+	mutex_init(&sn->mtx);
+	mutex_init(&sn->bench_mtx);
+
+	hooknum = sniff_hook_parse(hook);
+	if (hooknum < 0)
+		return hooknum;
+
+	sn->ops[0].hook = hook_func;		// the hook function
+	sn->ops[0].pf = NFPROTO_IPV4;		// IPv4 packets
+	sn->ops[1].hook = hook_func_v6;
+	sn->ops[1].pf = NFPROTO_IPV6;
+	for (int i = 0; i < ARRAY_SIZE(sn->ops); i++)
+		sn->ops[i].priv = sn;
+	sniff_net_set_hook(sn, hooknum, priority);
+
+	sn->stats = alloc_percpu(struct sniff_stats);
+	if (!sn->stats)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(sn->stats, cpu)->syncp);
+
+	// /proc/net/sniff/patterns: read to list, write to replace the set
+	// /proc/net/sniff/filter: source prefixes and ports worth scanning
+	// /proc/net/sniff/hook: hook point and priority
+	// /proc/net/sniff/stats: counters summed over all CPUs
+	// /proc/net/sniff/rings: depth, high-water mark and drops per async ring
+	// /proc/net/sniff/bench: write a configuration to run, read the result
+	sn->proc_dir = proc_mkdir("sniff", net->proc_net);
+	if (!sn->proc_dir ||
+	    !proc_create_data("patterns", 0600, sn->proc_dir, &sniff_patterns_ops, sn) ||
+	    !proc_create_data("filter", 0600, sn->proc_dir, &sniff_filter_ops, sn) ||
+	    !proc_create_data("hook", 0600, sn->proc_dir, &sniff_hook_ops, sn) ||
+	    !proc_create_single_data("stats", 0444, sn->proc_dir, sniff_stats_show, sn) ||
+	    !proc_create_single_data("rings", 0444, sn->proc_dir, sniff_rings_show, sn) ||
+	    !proc_create_data("bench", 0600, sn->proc_dir, &sniff_bench_ops, sn)) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	// only the initial namespace starts out with the search_str pattern
+	if (net_eq(net, &init_net)) {
+		text = kstrdup(search_str, GFP_KERNEL);
+		if (!text) {
+			ret = -ENOMEM;
+			goto err;
+		}
+		rules = sniff_rules_parse(text, strlen(text));
+		kfree(text);
+		if (IS_ERR(rules)) {
+			ret = PTR_ERR(rules);
+			goto err;
+		}
+	}
+
+	if (rules) {
+		ret = sniff_rules_publish(sn, rules);
+		if (ret)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	proc_remove(sn->proc_dir);
+	free_percpu(sn->stats);
+	return ret;
+}
+
+static void __net_exit sniff_net_exit(struct net *net)
+{
+	struct sniff_net *sn = net_generic(net, sniff_net_id);
+
+	mutex_lock(&sn->mtx);
+	sniff_net_hook(sn, false);
+	mutex_unlock(&sn->mtx);
+
+	proc_remove(sn->proc_dir);
+
+	// the hook is gone, but the ring workers may still hold packets
+	wait_var_event(&sn->inflight, !atomic_read(&sn->inflight));
+
+	sniff_rules_free(rcu_dereference_protected(sn->rules, 1));
+	sniff_filter_free(rcu_dereference_protected(sn->filter, 1));
+	kfree(sn->bench);
+	free_percpu(sn->stats);
+}
+
+static struct pernet_operations sniff_net_ops = {
+	.init = sniff_net_init,
+	.exit = sniff_net_exit,
+	.id = &sniff_net_id,
+	.size = sizeof(struct sniff_net),
+};
+
 static int __init sniff_init(void)
 {
-	nfho.hook = hook_func;			// the hook function
-	nfho.hooknum = NF_INET_PRE_ROUTING;	// hook at the pre-routing stage
-	nfho.pf = PF_INET;			// IPv4 packets
-	nfho.priority = NF_IP_PRI_FIRST;	// highest priority
+	int ret;
+
+	if (prefilter_bench)
+		sniff_simd_bench();
+
+	ret = sniff_flow_init();
+	if (ret)
+		return ret;
+
+	ret = sniff_event_init();
+	if (ret) {
+		sniff_flow_exit();
+		return ret;
+	}
+
+	ret = sniff_async_init();
+	if (ret) {
+		sniff_event_exit();
+		sniff_flow_exit();
+		return ret;
+	}
 
-	// register the hook
-	nf_register_net_hook(&init_net, &nfho);
+	// instantiates state and hooks in every namespace, present and future
+	ret = register_pernet_subsys(&sniff_net_ops);
+	if (ret) {
+		sniff_async_exit();
+		sniff_event_exit();
+		sniff_flow_exit();
+		return ret;
+	}
 	pr_info("Netfilter module loaded\n");
 
 	return 0;
@@ -59,7 +1325,10 @@ static int __init sniff_init(void)
 
 static void __exit sniff_exit(void)
 {
-	nf_unregister_net_hook(&init_net, &nfho);
+	unregister_pernet_subsys(&sniff_net_ops);
+	sniff_async_exit();
+	sniff_event_exit();
+	sniff_flow_exit();
 	pr_info("Netfilter module unloaded\n");
 }
 
@@ -68,4 +1337,3 @@ module_exit(sniff_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Me");
-
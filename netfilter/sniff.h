@@ -0,0 +1,181 @@
+#ifndef __SNIFF_H__
+#define __SNIFF_H__
+
+#include <linux/types.h>
+#include <linux/in6.h>
+#include <linux/rhashtable-types.h>
+
+/*
+ * Aho-Corasick automaton over a set of byte patterns.
+ * Built in process context, scanned lock-free from the hook.
+ */
+struct sniff_ac;
+
+/*
+ * Called for every match: @pattern is the index into the set the automaton
+ * was built from, @end is the offset just past the last matched byte.
+ * Return true to stop scanning.
+ */
+typedef bool (*sniff_match_fn)(unsigned int pattern, unsigned int end, void *arg);
+
+/*
+ * Payload prefilter: bytes of which every pattern contains at least one.
+ * Only the neighbourhood of such bytes needs to go through the automaton.
+ */
+struct sniff_anchors {
+	u8 map[256];			/* non-zero for anchor bytes */
+	unsigned int nbytes;
+	u8 bcast[4][16];		/* SSE2: up to four anchors, broadcast */
+	u8 lo[2][16];			/* AVX2: nibble tables, bit 7 clear/set */
+};
+
+enum sniff_simd {
+	SNIFF_SIMD_NONE,
+	SNIFF_SIMD_SSE2,
+	SNIFF_SIMD_AVX2,
+};
+
+void sniff_anchors_init(struct sniff_anchors *a);
+enum sniff_simd sniff_simd_begin(const struct sniff_anchors *a, unsigned int len);
+void sniff_simd_end(enum sniff_simd simd);
+unsigned int sniff_find_anchor(const struct sniff_anchors *a, enum sniff_simd simd,
+			       const u8 *data, unsigned int i, unsigned int len);
+void sniff_simd_bench(void);
+
+struct sniff_ac *sniff_ac_build(u8 * const *pats, const unsigned int *lens,
+				unsigned int npats);
+void sniff_ac_free(struct sniff_ac *ac);
+unsigned int sniff_ac_states(const struct sniff_ac *ac);
+
+/*
+ * Feed @len bytes to the automaton starting from *@state (0 = start) and
+ * leave the final state in *@state, so a scan can be resumed over the next
+ * chunk. Returns the number of matches reported.
+ */
+unsigned int sniff_ac_scan(const struct sniff_ac *ac, u32 *state,
+			   const u8 *data, unsigned int len,
+			   sniff_match_fn fn, void *arg);
+
+/* A compiled pattern set; replaced as a whole and freed after a grace period */
+struct sniff_rules {
+	struct sniff_ac *ac;
+	unsigned int npatterns;
+	u32 gen;		/* unique among loaded sets, low 16 bits never 0 */
+	u64 __percpu *hits;	/* per pattern match counts */
+	unsigned int *len;
+	u8 **pat;
+	u8 blob[];
+};
+
+/*
+ * Flow table, keyed by namespace and 5-tuple; one table serves every
+ * namespace. IPv4 addresses are stored v4-mapped. The key is hashed and
+ * compared as raw bytes, so it must be zeroed first.
+ */
+struct sniff_flow_key {
+	u64 net;		/* net->net_cookie */
+	struct in6_addr saddr;
+	struct in6_addr daddr;
+	__be16 sport;
+	__be16 dport;
+	u8 family;
+	u8 proto;
+	u16 pad;
+};
+
+enum sniff_verdict {
+	SNIFF_FLOW_SCAN,	/* still being inspected */
+	SNIFF_FLOW_MATCHED,	/* matched, nothing more to learn */
+	SNIFF_FLOW_DONE,	/* scan budget used up without a match */
+};
+
+struct sniff_flow {
+	struct rhash_head node;
+	struct sniff_flow_key key;
+	unsigned long last_seen;	/* jiffies */
+	u32 scanned;			/* payload bytes scanned so far */
+	u8 verdict;			/* enum sniff_verdict */
+	u64 cursor;			/* TCP: seq << 32 | gen << 16 | state, see sniff.c */
+	struct rcu_head rcu;
+};
+
+/* What the hook learned about a packet from its headers */
+struct sniff_pkt {
+	struct sniff_flow_key key;
+	unsigned int from;	/* payload offset */
+	u32 seq;		/* TCP: sequence number of the first payload byte */
+	bool stream;		/* TCP: scan state carries over between segments */
+	bool fin;		/* TCP: FIN or RST, the flow ends */
+};
+
+/* Source prefix / destination port filter, swapped under RCU like rules */
+struct sniff_filter;
+struct seq_file;
+
+struct sniff_filter *sniff_filter_parse(char *text);
+void sniff_filter_free(struct sniff_filter *f);
+bool sniff_filter_match(const struct sniff_filter *f, const struct sniff_flow_key *key);
+void sniff_filter_show(struct seq_file *m, const struct sniff_filter *f);
+
+struct sniff_flow *sniff_flow_get(const struct sniff_flow_key *key);
+struct sniff_flow *sniff_flow_lookup(const struct sniff_flow_key *key);
+void sniff_flow_del(struct sniff_flow *flow);
+void sniff_flow_forget(const struct sniff_flow_key *key);
+unsigned int sniff_flow_count(void);
+int sniff_flow_init(void);
+void sniff_flow_exit(void);
+
+/*
+ * Async inspection: per-CPU rings of cloned packets, drained by one worker
+ * thread per CPU. sniff_async_inspect() is the consumer, in sniff.c.
+ */
+struct sk_buff;
+
+bool sniff_async_queue(void *priv, struct sk_buff *skb, const struct sniff_pkt *pkt);
+void sniff_async_inspect(void *priv, struct sk_buff *skb, const struct sniff_pkt *pkt);
+void sniff_async_show(struct seq_file *m);
+int sniff_async_init(void);
+void sniff_async_exit(void);
+
+/* Match records for userspace, mmap()ed from /dev/sniff; see sniff_event.h */
+void sniff_event_emit(struct sk_buff *skb, const struct sniff_pkt *pkt, unsigned int pattern,
+		      unsigned int offset, unsigned int matches);
+int sniff_event_init(void);
+void sniff_event_exit(void);
+
+/*
+ * Benchmark of the hook on synthetic packets, run on every online CPU.
+ * The first block is parsed from the user, hook to pat is filled in by
+ * the caller, the rest holds the results.
+ */
+struct nf_hook_state;
+
+struct sniff_bench {
+	u8 family;		/* NFPROTO_IPV4 or NFPROTO_IPV6 */
+	u8 proto;		/* IPPROTO_TCP or IPPROTO_UDP */
+	unsigned int size;	/* payload bytes */
+	unsigned int frags;	/* page frags holding the payload, 0 = linear */
+	unsigned int match;	/* percent of packets carrying a pattern */
+	unsigned int flows;	/* 5-tuples per CPU */
+	u64 packets;		/* per CPU */
+
+	unsigned int (*hook)(void *priv, struct sk_buff *skb,
+			     const struct nf_hook_state *state);
+	void *priv;
+	u64 cookie;		/* net->net_cookie, to find the flows again */
+	const u8 *pat;
+	unsigned int patlen;
+
+	unsigned int cpus;
+	u64 done;		/* packets, all CPUs */
+	u64 ns;			/* time in the hook, all CPUs */
+	u64 cycles;
+	u64 bytes;		/* payload bytes */
+	u64 pps;		/* sum of the per CPU rates */
+};
+
+int sniff_bench_parse(char *text, struct sniff_bench *b);
+int sniff_bench_run(struct sniff_bench *b);
+void sniff_bench_show(struct seq_file *m, const struct sniff_bench *b);
+
+#endif /* __SNIFF_H__ */
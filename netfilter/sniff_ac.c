@@ -0,0 +1,389 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/err.h>
+#include <linux/ctype.h>
+#include <linux/string.h>
+
+#include "sniff.h"
+
+#define SNIFF_AC_STATES_MAX	U16_MAX
+#define SNIFF_AC_MEM_MAX	(32 << 20)	/* transition table, bytes */
+
+/*
+ * The prefilter only pays off if anchors are rare: at most this many per
+ * 1024 payload bytes, by the estimate in sniff_byte_freq().
+ */
+#define SNIFF_PREFILTER_DENSITY	64
+#define SNIFF_PREFILTER_MIN	256	/* shorter chunks go straight to the DFA */
+
+/*
+ * Full DFA: every state has a transition for every byte class, so the scan
+ * loop is one table load per byte with no failure-link chasing.
+ *
+ * Bytes that appear in no pattern all share class 0, which keeps rows short;
+ * rows are padded to a power of two so a row is found with a shift.
+ *
+ * States are renumbered so that all states reporting a match come last:
+ * the hot loop only has to compare against @term.
+ *
+ * Each pattern also gets an anchor, its rarest byte. Since every match
+ * contains the anchor of its pattern, long chunks are searched for anchor
+ * bytes first (with SIMD where possible) and only the window around each
+ * one, @before bytes back to after[c] bytes on, is fed to the DFA. The
+ * look-back is the same for every anchor so that windows start in order.
+ */
+struct sniff_ac {
+	u16 *delta;		/* nstates rows of (1 << shift) next states */
+	u32 *out;		/* per terminal state: first pattern ending here + 1 */
+	u16 *dict;		/* per terminal state: next suffix state with output */
+	u32 *next;		/* per pattern: next pattern with the same bytes + 1 */
+	unsigned int nstates;
+	unsigned int term;	/* states >= term report matches */
+	unsigned int shift;
+	unsigned int maxlen;	/* longest pattern */
+	bool prefilter;		/* anchors are rare enough to be worth it */
+	u16 cls[256];
+	unsigned int before;	/* longest pattern prefix before its anchor */
+	u16 after[256];		/* per anchor: longest suffix from it on */
+	struct sniff_anchors anchors;
+};
+
+void sniff_ac_free(struct sniff_ac *ac)
+{
+	if (!ac)
+		return;
+
+	kvfree(ac->delta);
+	kvfree(ac->out);
+	kvfree(ac->dict);
+	kvfree(ac->next);
+	kfree(ac);
+}
+
+unsigned int sniff_ac_states(const struct sniff_ac *ac)
+{
+	return ac->nstates;
+}
+
+/* Renumber states so the ones with output are >= ac->term. */
+static int sniff_ac_renumber(struct sniff_ac *ac, u16 *delta, const u32 *out,
+			     const u16 *dict)
+{
+	unsigned int stride = 1U << ac->shift;
+	unsigned int s, c, id = 0, nterm;
+	u16 *map;
+
+	map = kvmalloc_array(ac->nstates, sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+
+	/* The start state never has output, so it stays state 0. */
+	for (s = 0; s < ac->nstates; s++)
+		if (!out[s] && !dict[s])
+			map[s] = id++;
+	ac->term = id;
+	for (s = 0; s < ac->nstates; s++)
+		if (out[s] || dict[s])
+			map[s] = id++;
+	nterm = ac->nstates - ac->term;
+
+	ac->delta = kvmalloc_array((size_t)ac->nstates << ac->shift,
+				   sizeof(*ac->delta), GFP_KERNEL);
+	ac->out = kvcalloc(max(nterm, 1U), sizeof(*ac->out), GFP_KERNEL);
+	ac->dict = kvcalloc(max(nterm, 1U), sizeof(*ac->dict), GFP_KERNEL);
+	if (!ac->delta || !ac->out || !ac->dict) {
+		kvfree(map);
+		return -ENOMEM;
+	}
+
+	for (s = 0; s < ac->nstates; s++) {
+		u16 *row = &ac->delta[(size_t)map[s] << ac->shift];
+
+		for (c = 0; c < stride; c++)
+			row[c] = map[delta[((size_t)s << ac->shift) + c]];
+
+		if (map[s] >= ac->term) {
+			ac->out[map[s] - ac->term] = out[s];
+			ac->dict[map[s] - ac->term] = dict[s] ? map[dict[s]] : 0;
+		}
+	}
+
+	kvfree(map);
+	return 0;
+}
+
+/*
+ * Rough share, per 1024 bytes, of a byte value in mixed traffic: text
+ * protocols are mostly lowercase, whitespace and digits; binary payloads
+ * are close to uniform, about 4 per 1024 for any value.
+ */
+static unsigned int sniff_byte_freq(u8 c)
+{
+	if (c == 0x00 || c == ' ')
+		return 40;
+	if (strchr("etaoinsr", c))
+		return 24;
+	if (islower(c) || isdigit(c) || c == '\r' || c == '\n' || c == 0xff)
+		return 10;
+	if (isupper(c) || ispunct(c))
+		return 5;
+	return 4;
+}
+
+/* Pick an anchor for every pattern, sharing anchors where it costs nothing. */
+static void sniff_ac_anchors(struct sniff_ac *ac, u8 * const *pats,
+			     const unsigned int *lens, unsigned int npats)
+{
+	struct sniff_anchors *a = &ac->anchors;
+	unsigned int i, j, best, density = 0;
+
+	for (i = 0; i < npats; i++) {
+		const u8 *p = pats[i];
+
+		for (best = 0, j = 1; j < lens[i]; j++) {
+			unsigned int f = sniff_byte_freq(p[j]);
+			unsigned int fbest = sniff_byte_freq(p[best]);
+
+			if (f < fbest || (f == fbest && a->map[p[j]] && !a->map[p[best]]))
+				best = j;
+		}
+
+		a->map[p[best]] = 1;
+		ac->before = max(ac->before, best);
+		ac->after[p[best]] = max_t(unsigned int, ac->after[p[best]], lens[i] - best);
+		ac->maxlen = max(ac->maxlen, lens[i]);
+	}
+
+	for (i = 0; i < 256; i++)
+		if (a->map[i])
+			density += sniff_byte_freq(i);
+
+	ac->prefilter = density <= SNIFF_PREFILTER_DENSITY;
+	sniff_anchors_init(a);
+}
+
+struct sniff_ac *sniff_ac_build(u8 * const *pats, const unsigned int *lens,
+				unsigned int npats)
+{
+	unsigned int total = 1, nclasses = 1, nstates = 1;
+	unsigned int head = 0, tail = 0;
+	unsigned int i, j, s, c, stride;
+	struct sniff_ac *ac;
+	u16 *delta = NULL, *fail = NULL, *dict = NULL, *queue = NULL;
+	u32 *out = NULL;
+	int ret = -ENOMEM;
+
+	for (i = 0; i < npats; i++) {
+		if (!lens[i])
+			return ERR_PTR(-EINVAL);
+		total += lens[i];
+		if (total > SNIFF_AC_STATES_MAX)
+			return ERR_PTR(-E2BIG);
+	}
+
+	ac = kzalloc(sizeof(*ac), GFP_KERNEL);
+	if (!ac)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < npats; i++)
+		for (j = 0; j < lens[i]; j++)
+			if (!ac->cls[pats[i][j]])
+				ac->cls[pats[i][j]] = nclasses++;
+
+	ac->shift = order_base_2(nclasses);
+	stride = 1U << ac->shift;
+	if ((size_t)total * stride * sizeof(u16) > SNIFF_AC_MEM_MAX) {
+		ret = -E2BIG;
+		goto out_free;
+	}
+
+	delta = kvcalloc((size_t)total << ac->shift, sizeof(*delta), GFP_KERNEL);
+	out = kvcalloc(total, sizeof(*out), GFP_KERNEL);
+	fail = kvcalloc(total, sizeof(*fail), GFP_KERNEL);
+	dict = kvcalloc(total, sizeof(*dict), GFP_KERNEL);
+	queue = kvmalloc_array(total, sizeof(*queue), GFP_KERNEL);
+	ac->next = kvcalloc(max(npats, 1U), sizeof(*ac->next), GFP_KERNEL);
+	if (!delta || !out || !fail || !dict || !queue || !ac->next)
+		goto out_free;
+
+	/* Trie. State 0 is the root and is never a child, so 0 means "none". */
+	for (i = 0; i < npats; i++) {
+		s = 0;
+		for (j = 0; j < lens[i]; j++) {
+			u16 *t = &delta[((size_t)s << ac->shift) + ac->cls[pats[i][j]]];
+
+			if (!*t)
+				*t = nstates++;
+			s = *t;
+		}
+		ac->next[i] = out[s];
+		out[s] = i + 1;
+	}
+	ac->nstates = nstates;
+
+	/*
+	 * Breadth-first: failure links, output (dictionary) links, and the
+	 * missing transitions borrowed from the failure state, whose row is
+	 * already complete because it is shallower.
+	 */
+	for (c = 0; c < nclasses; c++)
+		if (delta[c])
+			queue[tail++] = delta[c];
+
+	while (head < tail) {
+		u16 *row, *frow;
+
+		s = queue[head++];
+		dict[s] = out[fail[s]] ? fail[s] : dict[fail[s]];
+
+		row = &delta[(size_t)s << ac->shift];
+		frow = &delta[(size_t)fail[s] << ac->shift];
+		for (c = 0; c < nclasses; c++) {
+			if (row[c]) {
+				fail[row[c]] = frow[c];
+				queue[tail++] = row[c];
+			} else {
+				row[c] = frow[c];
+			}
+		}
+	}
+
+	ret = sniff_ac_renumber(ac, delta, out, dict);
+	if (ret)
+		goto out_free;
+
+	sniff_ac_anchors(ac, pats, lens, npats);
+
+	kvfree(delta);
+	kvfree(out);
+	kvfree(fail);
+	kvfree(dict);
+	kvfree(queue);
+
+	pr_debug("automaton: %u patterns, %u states, %u classes, %zu bytes, %u anchors%s\n",
+		 npats, nstates, nclasses, (size_t)nstates * stride * sizeof(u16),
+		 ac->anchors.nbytes, ac->prefilter ? "" : " (prefilter off)");
+
+	return ac;
+
+out_free:
+	kvfree(delta);
+	kvfree(out);
+	kvfree(fail);
+	kvfree(dict);
+	kvfree(queue);
+	sniff_ac_free(ac);
+	return ERR_PTR(ret);
+}
+
+static unsigned int sniff_ac_report(const struct sniff_ac *ac, unsigned int s,
+				    unsigned int end, sniff_match_fn fn,
+				    void *arg, bool *stop)
+{
+	unsigned int hits = 0, p;
+
+	do {
+		for (p = ac->out[s - ac->term]; p; p = ac->next[p - 1]) {
+			hits++;
+			if (fn && fn(p - 1, end, arg)) {
+				*stop = true;
+				return hits;
+			}
+		}
+		s = ac->dict[s - ac->term];
+	} while (s);
+
+	return hits;
+}
+
+/* Feed data[from..to) to the DFA; match offsets are relative to @data. */
+static __always_inline unsigned int sniff_ac_feed(const struct sniff_ac *ac, unsigned int *state,
+						  const u8 *data, unsigned int from,
+						  unsigned int to, sniff_match_fn fn,
+						  void *arg, bool *stop)
+{
+	const u16 *delta = ac->delta;
+	const u16 *cls = ac->cls;
+	unsigned int shift = ac->shift, term = ac->term;
+	unsigned int s = *state, hits = 0, i;
+
+	for (i = from; i < to; i++) {
+		s = delta[(s << shift) | cls[data[i]]];
+		if (unlikely(s >= term)) {
+			hits += sniff_ac_report(ac, s, i + 1, fn, arg, stop);
+			if (*stop)
+				break;
+		}
+	}
+
+	*state = s;
+	return hits;
+}
+
+/*
+ * Only windows around anchor bytes are fed; where two windows overlap the
+ * DFA simply carries on, where they don't it restarts from state 0 at the
+ * start of the next one. Either way no byte is fed twice, so no match is
+ * reported twice.
+ */
+static unsigned int sniff_ac_scan_windows(const struct sniff_ac *ac, u32 *state,
+					  const u8 *data, unsigned int len,
+					  sniff_match_fn fn, void *arg)
+{
+	const struct sniff_anchors *a = &ac->anchors;
+	unsigned int s = *state, e, p, lo, hi, hits;
+	enum sniff_simd simd;
+	bool stop = false;
+
+	// matches that started in an earlier chunk end within maxlen - 1 bytes
+	e = ac->maxlen - 1;
+	hits = sniff_ac_feed(ac, &s, data, 0, e, fn, arg, &stop);
+
+	simd = sniff_simd_begin(a, len);
+	for (p = 0; !stop; p++) {
+		p = sniff_find_anchor(a, simd, data, p, len);
+		if (p >= len)
+			break;
+
+		hi = min(len, p + ac->after[data[p]]);
+		if (hi <= e)
+			continue;
+
+		lo = p - min(p, ac->before);
+		if (lo > e) {
+			s = 0;
+			e = lo;
+		}
+		hits += sniff_ac_feed(ac, &s, data, e, hi, fn, arg, &stop);
+		e = hi;
+	}
+	sniff_simd_end(simd);
+
+	/*
+	 * The state to carry into the next chunk only depends on the last
+	 * maxlen bytes. Every match in them was already reported, so this
+	 * pass just recomputes the state.
+	 */
+	s = 0;
+	sniff_ac_feed(ac, &s, data, len - ac->maxlen, len, NULL, NULL, &stop);
+
+	*state = s;
+	return hits;
+}
+
+unsigned int sniff_ac_scan(const struct sniff_ac *ac, u32 *state,
+			   const u8 *data, unsigned int len,
+			   sniff_match_fn fn, void *arg)
+{
+	unsigned int s = *state, hits;
+	bool stop = false;
+
+	if (ac->prefilter && len >= max(SNIFF_PREFILTER_MIN, 2 * ac->maxlen))
+		return sniff_ac_scan_windows(ac, state, data, len, fn, arg);
+
+	hits = sniff_ac_feed(ac, &s, data, 0, len, fn, arg, &stop);
+	*state = s;
+	return hits;
+}
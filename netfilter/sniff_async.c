@@ -0,0 +1,198 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/smpboot.h>
+#include <linux/sched.h>
+#include <linux/skbuff.h>
+#include <linux/bottom_half.h>
+#include <linux/rcupdate.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+
+#include "sniff.h"
+
+#define SNIFF_ASYNC_BATCH	64	/* packets per BH-disabled section */
+
+static unsigned int ring_size = 1024;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Packets queued per CPU for async inspection (default=1024)");
+
+struct sniff_async_item {
+	struct sk_buff *skb;
+	void *priv;
+	struct sniff_pkt pkt;
+};
+
+/*
+ * One ring per CPU. The producer is the hook on that CPU, the consumer the
+ * worker thread bound to it, so the two never run at the same time: the
+ * worker drains with BH disabled and the hook runs in softirq. Both only
+ * ever move their own index forward.
+ */
+struct sniff_ring {
+	unsigned int head;		/* next free slot, hook only */
+	unsigned int tail;		/* next to inspect, worker only */
+	unsigned int mask;
+	unsigned int hiwat;		/* highest depth seen */
+	unsigned long drops;		/* ring full or CPU going down */
+	unsigned long done;
+	bool parked;			/* CPU going down, nothing may be queued */
+	struct sniff_async_item items[];
+};
+
+static DEFINE_PER_CPU(struct sniff_ring *, sniff_rings);
+static DEFINE_PER_CPU(struct task_struct *, sniff_async_task);
+
+/*
+ * Queue a clone of a packet for the worker of this CPU, which passes it to
+ * sniff_async_inspect(). Called from the hook; returns false, leaving @skb
+ * to the caller, when the ring is full.
+ */
+bool sniff_async_queue(void *priv, struct sk_buff *skb, const struct sniff_pkt *pkt)
+{
+	struct sniff_ring *r = this_cpu_read(sniff_rings);
+	unsigned int head = r->head, depth = head - READ_ONCE(r->tail);
+	struct sniff_async_item *it;
+
+	if (unlikely(depth > r->mask || READ_ONCE(r->parked))) {
+		WRITE_ONCE(r->drops, r->drops + 1);
+		return false;
+	}
+
+	it = &r->items[head & r->mask];
+	it->skb = skb;
+	it->priv = priv;
+	it->pkt = *pkt;
+	smp_store_release(&r->head, head + 1);
+
+	if (depth + 1 > r->hiwat)
+		WRITE_ONCE(r->hiwat, depth + 1);
+
+	// the worker only goes to sleep with the ring empty
+	if (!depth)
+		wake_up_process(__this_cpu_read(sniff_async_task));
+	return true;
+}
+
+static void sniff_async_drain(struct sniff_ring *r)
+{
+	unsigned int tail = r->tail, head, n = 0;
+
+	// the same context the hook would have inspected them in
+	local_bh_disable();
+	rcu_read_lock();
+	head = smp_load_acquire(&r->head);
+	while (tail != head && n < SNIFF_ASYNC_BATCH) {
+		struct sniff_async_item *it = &r->items[tail & r->mask];
+
+		sniff_async_inspect(it->priv, it->skb, &it->pkt);
+		tail++;
+		n++;
+	}
+	rcu_read_unlock();
+	WRITE_ONCE(r->tail, tail);
+	WRITE_ONCE(r->done, r->done + n);
+	local_bh_enable();
+}
+
+static int sniff_async_should_run(unsigned int cpu)
+{
+	struct sniff_ring *r = per_cpu(sniff_rings, cpu);
+
+	return READ_ONCE(r->head) != r->tail;
+}
+
+static void sniff_async_run(unsigned int cpu)
+{
+	sniff_async_drain(per_cpu(sniff_rings, cpu));
+	cond_resched();
+}
+
+/*
+ * CPU going down: stop the hook from queueing here, then empty the ring so
+ * nothing is left behind while the CPU is offline.
+ */
+static void sniff_async_park(unsigned int cpu)
+{
+	struct sniff_ring *r = per_cpu(sniff_rings, cpu);
+
+	local_bh_disable();
+	WRITE_ONCE(r->parked, true);
+	local_bh_enable();
+
+	while (sniff_async_should_run(cpu))
+		sniff_async_drain(r);
+}
+
+static void sniff_async_unpark(unsigned int cpu)
+{
+	WRITE_ONCE(per_cpu(sniff_rings, cpu)->parked, false);
+}
+
+static struct smp_hotplug_thread sniff_async_threads = {
+	.store = &sniff_async_task,
+	.thread_should_run = sniff_async_should_run,
+	.thread_fn = sniff_async_run,
+	.park = sniff_async_park,
+	.unpark = sniff_async_unpark,
+	.thread_comm = "sniff/%u",
+};
+
+void sniff_async_show(struct seq_file *m)
+{
+	unsigned int cpu;
+
+	seq_printf(m, "size %u\n", ring_size);
+	for_each_online_cpu(cpu) {
+		const struct sniff_ring *r = per_cpu(sniff_rings, cpu);
+
+		seq_printf(m, "cpu%u depth %u max %u drops %lu done %lu\n", cpu,
+			   READ_ONCE(r->head) - READ_ONCE(r->tail), READ_ONCE(r->hiwat),
+			   READ_ONCE(r->drops), READ_ONCE(r->done));
+	}
+}
+
+static void sniff_async_free(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kvfree(per_cpu(sniff_rings, cpu));
+		per_cpu(sniff_rings, cpu) = NULL;
+	}
+}
+
+int sniff_async_init(void)
+{
+	unsigned int cpu;
+	int ret;
+
+	ring_size = roundup_pow_of_two(clamp(ring_size, 16U, 65536U));
+
+	for_each_possible_cpu(cpu) {
+		struct sniff_ring *r;
+
+		r = kvzalloc_node(struct_size(r, items, ring_size), GFP_KERNEL,
+				  cpu_to_node(cpu));
+		if (!r) {
+			sniff_async_free();
+			return -ENOMEM;
+		}
+		r->mask = ring_size - 1;
+		per_cpu(sniff_rings, cpu) = r;
+	}
+
+	ret = smpboot_register_percpu_thread(&sniff_async_threads);
+	if (ret)
+		sniff_async_free();
+	return ret;
+}
+
+/* Called once every namespace, and so every queued packet, is gone. */
+void sniff_async_exit(void)
+{
+	smpboot_unregister_percpu_thread(&sniff_async_threads);
+	sniff_async_free();
+}
@@ -0,0 +1,363 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/in.h>
+#include <linux/if_ether.h>
+#include <linux/netfilter.h>
+#include <linux/workqueue.h>
+#include <linux/cpu.h>
+#include <linux/random.h>
+#include <linux/timex.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <net/ipv6.h>
+
+#include "sniff.h"
+
+/*
+ * Every CPU reuses a pool of prebuilt packets; the hook never consumes or
+ * changes them, so the same skbs can go through it again and again.
+ */
+#define SNIFF_BENCH_POOL	100	/* packets, so match= is an exact percentage */
+#define SNIFF_BENCH_BATCH	16	/* hook calls per BH-disabled section */
+#define SNIFF_BENCH_SIZE_MAX	60000
+
+struct sniff_bench_cpu {
+	struct work_struct work;
+	struct sniff_bench *b;
+	unsigned int cpu;
+	struct sk_buff *pool[SNIFF_BENCH_POOL];
+	u64 done, ns, cycles, bytes;
+	int err;
+};
+
+static const char * const sniff_bench_protos[] = {
+	[IPPROTO_TCP] = "tcp",
+	[IPPROTO_UDP] = "udp",
+};
+
+/*
+ * Addresses come from the benchmarking ranges, 198.18.0.0/15 (RFC 2544)
+ * and 2001:2::/48 (RFC 5180); the source differs per CPU and the source
+ * port per flow, so no two CPUs ever share a flow.
+ */
+static void sniff_bench_addrs(const struct sniff_bench *b, unsigned int cpu,
+			      struct in6_addr *saddr, struct in6_addr *daddr)
+{
+	if (b->family == NFPROTO_IPV4) {
+		ipv6_addr_set_v4mapped(htonl(0xc6120000 | (cpu & 0xffff)), saddr);
+		ipv6_addr_set_v4mapped(htonl(0xc6130001), daddr);
+	} else {
+		ipv6_addr_set(saddr, htonl(0x20010002), 0, 0, htonl(cpu));
+		ipv6_addr_set(daddr, htonl(0x20010002), 0, 0, htonl(0x10000));
+	}
+}
+
+static __be16 sniff_bench_sport(unsigned int flow)
+{
+	return htons(1024 + flow);
+}
+
+static struct sk_buff *sniff_bench_skb(const struct sniff_bench *b, unsigned int cpu,
+				       unsigned int i, bool match)
+{
+	unsigned int nhlen = b->family == NFPROTO_IPV4 ? sizeof(struct iphdr) :
+							 sizeof(struct ipv6hdr);
+	unsigned int thlen = b->proto == IPPROTO_TCP ? sizeof(struct tcphdr) :
+						       sizeof(struct udphdr);
+	unsigned int linear = b->frags ? 0 : b->size;
+	struct in6_addr saddr, daddr;
+	struct sk_buff *skb;
+	u8 *payload;
+
+	skb = alloc_skb(nhlen + thlen + linear, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	sniff_bench_addrs(b, cpu, &saddr, &daddr);
+
+	skb_reset_network_header(skb);
+	if (b->family == NFPROTO_IPV4) {
+		struct iphdr *iph = skb_put_zero(skb, nhlen);
+
+		iph->version = 4;
+		iph->ihl = nhlen / 4;
+		iph->ttl = 64;
+		iph->protocol = b->proto;
+		iph->tot_len = htons(nhlen + thlen + b->size);
+		iph->saddr = saddr.s6_addr32[3];
+		iph->daddr = daddr.s6_addr32[3];
+		skb->protocol = htons(ETH_P_IP);
+	} else {
+		struct ipv6hdr *ip6h = skb_put_zero(skb, nhlen);
+
+		ip6h->version = 6;
+		ip6h->hop_limit = 64;
+		ip6h->nexthdr = b->proto;
+		ip6h->payload_len = htons(thlen + b->size);
+		ip6h->saddr = saddr;
+		ip6h->daddr = daddr;
+		skb->protocol = htons(ETH_P_IPV6);
+	}
+
+	skb_set_transport_header(skb, nhlen);
+	if (b->proto == IPPROTO_TCP) {
+		struct tcphdr *th = skb_put_zero(skb, thlen);
+
+		th->source = sniff_bench_sport(i % b->flows);
+		th->dest = htons(80);
+		// the packets of each flow follow on from one another
+		th->seq = htonl(i / b->flows * b->size);
+		th->doff = thlen / 4;
+		th->ack = 1;
+	} else {
+		struct udphdr *uh = skb_put_zero(skb, thlen);
+
+		uh->source = sniff_bench_sport(i % b->flows);
+		uh->dest = htons(53);
+		uh->len = htons(thlen + b->size);
+	}
+
+	if (linear) {
+		payload = skb_put(skb, linear);
+		get_random_bytes(payload, linear);
+	}
+
+	// spread the payload evenly over the page frags
+	for (unsigned int f = 0, left = b->size; f < b->frags; f++) {
+		unsigned int len = DIV_ROUND_UP(left, b->frags - f);
+		struct page *page;
+
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			kfree_skb(skb);
+			return NULL;
+		}
+		get_random_bytes(page_address(page), len);
+		skb_add_rx_frag(skb, f, page, 0, len, PAGE_SIZE);
+		left -= len;
+	}
+
+	// in the middle, which with frags is usually across a frag border
+	if (match)
+		skb_store_bits(skb, nhlen + thlen + (b->size - b->patlen) / 2,
+			       b->pat, b->patlen);
+
+	return skb;
+}
+
+/* Drop the flows the hook created for this CPU, so verdicts start over. */
+static void sniff_bench_forget(const struct sniff_bench *b, unsigned int cpu)
+{
+	struct sniff_flow_key key;
+
+	memset(&key, 0, sizeof(key));
+	key.net = b->cookie;
+	sniff_bench_addrs(b, cpu, &key.saddr, &key.daddr);
+	key.dport = htons(b->proto == IPPROTO_TCP ? 80 : 53);
+	key.family = b->family;
+	key.proto = b->proto;
+
+	for (unsigned int f = 0; f < b->flows; f++) {
+		key.sport = sniff_bench_sport(f);
+		sniff_flow_forget(&key);
+	}
+}
+
+static void sniff_bench_cpu(struct work_struct *work)
+{
+	struct sniff_bench_cpu *bc = container_of(work, struct sniff_bench_cpu, work);
+	const struct sniff_bench *b = bc->b;
+	struct nf_hook_state state = {
+		.hook = NF_INET_PRE_ROUTING,
+		.pf = b->family,
+	};
+	unsigned int i, n;
+
+	for (i = 0; i < SNIFF_BENCH_POOL; i++) {
+		// evenly spread, match% of every 100 packets
+		bool match = (i + 1) * b->match / 100 != i * b->match / 100;
+
+		bc->pool[i] = sniff_bench_skb(b, bc->cpu, i, match);
+		if (!bc->pool[i]) {
+			bc->err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	while (bc->done < b->packets) {
+		for (i = 0; i < SNIFF_BENCH_POOL && bc->done < b->packets; i += n) {
+			u64 t0, t1;
+			cycles_t c0, c1;
+
+			n = min_t(u64, min_t(unsigned int, SNIFF_BENCH_BATCH, SNIFF_BENCH_POOL - i),
+				  b->packets - bc->done);
+
+			// the context the hook normally runs in
+			local_bh_disable();
+			rcu_read_lock();
+			t0 = ktime_get_ns();
+			c0 = get_cycles();
+			for (unsigned int j = i; j < i + n; j++)
+				b->hook(b->priv, bc->pool[j], &state);
+			c1 = get_cycles();
+			t1 = ktime_get_ns();
+			rcu_read_unlock();
+			local_bh_enable();
+
+			bc->ns += t1 - t0;
+			bc->cycles += c1 - c0;
+			bc->done += n;
+			bc->bytes += (u64)n * b->size;
+			cond_resched();
+		}
+
+		// outside the timed sections
+		sniff_bench_forget(b, bc->cpu);
+	}
+
+out:
+	for (i = 0; i < SNIFF_BENCH_POOL; i++)
+		kfree_skb(bc->pool[i]);
+}
+
+/*
+ * Run the benchmark on every online CPU at once and fill in the results.
+ * Sleeps; the caller supplies the hook, its priv and the pattern to plant.
+ */
+int sniff_bench_run(struct sniff_bench *b)
+{
+	struct sniff_bench_cpu *bc;
+	unsigned int cpu;
+	int ret = 0;
+
+	if (b->match && (!b->pat || b->patlen > b->size))
+		return -EINVAL;
+
+	bc = kvcalloc(nr_cpu_ids, sizeof(*bc), GFP_KERNEL);
+	if (!bc)
+		return -ENOMEM;
+
+	b->cpus = 0;
+	b->done = b->ns = b->cycles = b->bytes = b->pps = 0;
+
+	cpus_read_lock();
+	for_each_online_cpu(cpu) {
+		bc[cpu].b = b;
+		bc[cpu].cpu = cpu;
+		INIT_WORK(&bc[cpu].work, sniff_bench_cpu);
+		queue_work_on(cpu, system_highpri_wq, &bc[cpu].work);
+	}
+	for_each_online_cpu(cpu) {
+		flush_work(&bc[cpu].work);
+		if (bc[cpu].err) {
+			ret = bc[cpu].err;
+			continue;
+		}
+
+		b->cpus++;
+		b->done += bc[cpu].done;
+		b->ns += bc[cpu].ns;
+		b->cycles += bc[cpu].cycles;
+		b->bytes += bc[cpu].bytes;
+		if (bc[cpu].ns)
+			b->pps += mul_u64_u64_div_u64(bc[cpu].done, NSEC_PER_SEC, bc[cpu].ns);
+	}
+	cpus_read_unlock();
+
+	kvfree(bc);
+	return ret;
+}
+
+/*
+ * Space separated key=value pairs, anything left out keeps its default:
+ * family=4|6 proto=tcp|udp size=<payload bytes> frags=<0 for linear>
+ * match=<percent> flows=<1-100> packets=<per CPU>
+ */
+int sniff_bench_parse(char *text, struct sniff_bench *b)
+{
+	char *tok, *val;
+	int ret = 0;
+
+	b->family = NFPROTO_IPV4;
+	b->proto = IPPROTO_TCP;
+	b->size = 1460;
+	b->frags = 0;
+	b->match = 0;
+	b->flows = SNIFF_BENCH_POOL;
+	b->packets = 100000;
+
+	while (!ret && (tok = strsep(&text, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
+
+		val = strchr(tok, '=');
+		if (!val)
+			return -EINVAL;
+		*val++ = '\0';
+
+		if (!strcmp(tok, "family")) {
+			if (!strcmp(val, "4"))
+				b->family = NFPROTO_IPV4;
+			else if (!strcmp(val, "6"))
+				b->family = NFPROTO_IPV6;
+			else
+				ret = -EINVAL;
+		} else if (!strcmp(tok, "proto")) {
+			if (!strcmp(val, "tcp"))
+				b->proto = IPPROTO_TCP;
+			else if (!strcmp(val, "udp"))
+				b->proto = IPPROTO_UDP;
+			else
+				ret = -EINVAL;
+		} else if (!strcmp(tok, "size")) {
+			ret = kstrtouint(val, 0, &b->size);
+		} else if (!strcmp(tok, "frags")) {
+			ret = kstrtouint(val, 0, &b->frags);
+		} else if (!strcmp(tok, "match")) {
+			ret = kstrtouint(val, 0, &b->match);
+		} else if (!strcmp(tok, "flows")) {
+			ret = kstrtouint(val, 0, &b->flows);
+		} else if (!strcmp(tok, "packets")) {
+			ret = kstrtou64(val, 0, &b->packets);
+		} else {
+			ret = -EINVAL;
+		}
+	}
+	if (ret)
+		return ret;
+
+	if (!b->size || b->size > SNIFF_BENCH_SIZE_MAX || b->match > 100 ||
+	    !b->flows || b->flows > SNIFF_BENCH_POOL || !b->packets ||
+	    b->frags > MAX_SKB_FRAGS || (b->frags && b->size > b->frags * PAGE_SIZE))
+		return -EINVAL;
+
+	return 0;
+}
+
+static void sniff_bench_print(struct seq_file *m, const char *name, u64 num, u64 den)
+{
+	seq_printf(m, "%s %llu.%02llu\n", name, div64_u64(num, den),
+		   div64_u64(num * 100, den) % 100);
+}
+
+void sniff_bench_show(struct seq_file *m, const struct sniff_bench *b)
+{
+	seq_printf(m, "family %u proto %s size %u frags %u match %u flows %u packets %llu\n",
+		   b->family == NFPROTO_IPV4 ? 4 : 6, sniff_bench_protos[b->proto],
+		   b->size, b->frags, b->match, b->flows, b->packets);
+	seq_printf(m, "cpus %u\npackets %llu\n", b->cpus, b->done);
+	if (!b->done || !b->ns || !b->cycles)
+		return;
+
+	// CPU time per packet; throughput of all CPUs together
+	sniff_bench_print(m, "ns_per_packet", b->ns, b->done);
+	sniff_bench_print(m, "mpps", b->pps, 1000000);
+	sniff_bench_print(m, "bytes_per_cycle", b->bytes, b->cycles);
+}
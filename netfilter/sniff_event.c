@@ -0,0 +1,201 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/skbuff.h>
+#include <linux/timekeeping.h>
+#include <linux/log2.h>
+
+#include "sniff.h"
+#include "sniff_event.h"
+
+static_assert(sizeof(struct sniff_event) == 128);
+
+static unsigned int events = 1024;
+module_param(events, uint, 0444);
+MODULE_PARM_DESC(events, "Match records per CPU in the /dev/sniff ring, 0 for no device (default=1024)");
+
+static unsigned int snaplen;
+module_param(snaplen, uint, 0644);
+MODULE_PARM_DESC(snaplen, "Payload bytes up to the match copied into each record, at most 60 (default=0)");
+
+/*
+ * Kernel side of one ring. head is kept here and only published to the
+ * shared page, which userspace can write to; only tail is read back, and
+ * checked before it is trusted.
+ */
+struct sniff_event_cpu {
+	struct sniff_event_ring *ring;
+	struct sniff_event *ev;
+	u32 head;
+	u64 drops;
+};
+
+static struct {
+	void *buf;			/* vmalloc_user(), mapped by the consumer */
+	size_t size;
+	u32 mask;
+	atomic_t users;			/* nothing is recorded while 0 */
+	wait_queue_head_t wq;
+} sniff_events;
+
+static DEFINE_PER_CPU(struct sniff_event_cpu, sniff_event_cpu);
+
+/*
+ * Record a matching packet on this CPU's ring. Called from the hook or the
+ * async worker, BH disabled. A full ring drops the record and counts it.
+ */
+void sniff_event_emit(struct sk_buff *skb, const struct sniff_pkt *pkt, unsigned int pattern,
+		      unsigned int offset, unsigned int matches)
+{
+	struct sniff_event_cpu *c;
+	struct sniff_event *ev;
+	unsigned int len;
+	u32 depth;
+
+	if (!atomic_read(&sniff_events.users))
+		return;
+
+	c = this_cpu_ptr(&sniff_event_cpu);
+	depth = c->head - READ_ONCE(c->ring->tail);
+	if (depth > sniff_events.mask) {
+		WRITE_ONCE(c->ring->drops, ++c->drops);
+		return;
+	}
+
+	ev = &c->ev[c->head & sniff_events.mask];
+	ev->ts = ktime_get_real_ns();
+	ev->netns = pkt->key.net;
+	memcpy(ev->saddr, &pkt->key.saddr, sizeof(ev->saddr));
+	memcpy(ev->daddr, &pkt->key.daddr, sizeof(ev->daddr));
+	ev->sport = pkt->key.sport;
+	ev->dport = pkt->key.dport;
+	ev->family = pkt->key.family;	// NFPROTO_IPV4/6 are AF_INET/6
+	ev->proto = pkt->key.proto;
+	ev->pattern = pattern;
+	ev->offset = offset;
+	ev->matches = matches;
+
+	len = min3(READ_ONCE(snaplen), offset, (unsigned int)SNIFF_EVENT_SNAPLEN);
+	if (len && skb_copy_bits(skb, pkt->from + offset - len, ev->data, len))
+		len = 0;
+	ev->caplen = len;
+
+	smp_store_release(&c->ring->head, ++c->head);
+
+	// the consumer only sleeps with every ring empty
+	if (!depth && wq_has_sleeper(&sniff_events.wq))
+		wake_up_interruptible_poll(&sniff_events.wq, EPOLLIN | EPOLLRDNORM);
+}
+
+static int sniff_event_open(struct inode *inode, struct file *file)
+{
+	atomic_inc(&sniff_events.users);
+	return nonseekable_open(inode, file);
+}
+
+static int sniff_event_release(struct inode *inode, struct file *file)
+{
+	atomic_dec(&sniff_events.users);
+	return 0;
+}
+
+static __poll_t sniff_event_poll(struct file *file, poll_table *wait)
+{
+	unsigned int cpu;
+
+	poll_wait(file, &sniff_events.wq, wait);
+
+	for_each_possible_cpu(cpu) {
+		const struct sniff_event_ring *ring = per_cpu(sniff_event_cpu, cpu).ring;
+
+		if (READ_ONCE(ring->head) != READ_ONCE(ring->tail))
+			return EPOLLIN | EPOLLRDNORM;
+	}
+	return 0;
+}
+
+static int sniff_event_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_EXEC)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYEXEC);
+
+	return remap_vmalloc_range(vma, sniff_events.buf, vma->vm_pgoff);
+}
+
+static const struct file_operations sniff_event_fops = {
+	.owner = THIS_MODULE,
+	.open = sniff_event_open,
+	.release = sniff_event_release,
+	.poll = sniff_event_poll,
+	.mmap = sniff_event_mmap,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice sniff_event_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "sniff",
+	.mode = 0600,
+	.fops = &sniff_event_fops,
+};
+
+int sniff_event_init(void)
+{
+	struct sniff_event_info *info;
+	size_t stride;
+	unsigned int cpu;
+	int ret;
+
+	if (!events)
+		return 0;
+
+	events = roundup_pow_of_two(clamp_t(unsigned int, events,
+					     PAGE_SIZE / sizeof(struct sniff_event), 1U << 20));
+	stride = PAGE_SIZE + events * sizeof(struct sniff_event);
+
+	sniff_events.size = PAGE_SIZE + nr_cpu_ids * stride;
+	sniff_events.buf = vmalloc_user(sniff_events.size);
+	if (!sniff_events.buf)
+		return -ENOMEM;
+	sniff_events.mask = events - 1;
+	init_waitqueue_head(&sniff_events.wq);
+
+	info = sniff_events.buf;
+	info->version = SNIFF_EVENT_VERSION;
+	info->nr_rings = nr_cpu_ids;
+	info->nr_events = events;
+	info->event_size = sizeof(struct sniff_event);
+	info->ring_offset = PAGE_SIZE;
+	info->ring_stride = stride;
+
+	for_each_possible_cpu(cpu) {
+		struct sniff_event_cpu *c = per_cpu_ptr(&sniff_event_cpu, cpu);
+
+		c->ring = sniff_events.buf + PAGE_SIZE + cpu * stride;
+		c->ev = (void *)c->ring + PAGE_SIZE;
+	}
+
+	ret = misc_register(&sniff_event_miscdev);
+	if (ret) {
+		vfree(sniff_events.buf);
+		sniff_events.buf = NULL;
+	}
+	return ret;
+}
+
+/* Called once the hooks and ring workers are gone. */
+void sniff_event_exit(void)
+{
+	if (!sniff_events.buf)
+		return;
+
+	misc_deregister(&sniff_event_miscdev);
+	vfree(sniff_events.buf);
+}
@@ -0,0 +1,56 @@
+#ifndef __SNIFF_EVENT_H__
+#define __SNIFF_EVENT_H__
+
+/*
+ * Match records shared with userspace through mmap() of /dev/sniff.
+ * Included by the module and by collectors alike.
+ *
+ * The mapping starts with a page holding struct sniff_event_info. Ring i,
+ * one per possible CPU id, starts ring_offset + i * ring_stride bytes in:
+ * a page with struct sniff_event_ring, then nr_events records. The kernel
+ * fills the record at head, then moves head on; the consumer reads the
+ * records from tail up to head, then moves tail on. Indexes run freely,
+ * record n is at n & (nr_events - 1). poll() reports EPOLLIN while any
+ * ring is not empty.
+ */
+
+#include <linux/types.h>
+
+#define SNIFF_EVENT_VERSION	1
+#define SNIFF_EVENT_SNAPLEN	60
+
+struct sniff_event_info {
+	__u32 version;
+	__u32 nr_rings;
+	__u32 nr_events;	/* per ring, a power of 2 */
+	__u32 event_size;
+	__u64 ring_offset;
+	__u64 ring_stride;
+};
+
+struct sniff_event_ring {
+	__u32 head;		/* written by the kernel */
+	__u32 pad0[15];
+	__u32 tail;		/* written by the consumer */
+	__u32 pad1[15];
+	__u64 drops;		/* records lost to a full ring */
+};
+
+/* One per matching packet */
+struct sniff_event {
+	__u64 ts;		/* CLOCK_REALTIME, ns */
+	__u64 netns;		/* network namespace cookie */
+	__u8 saddr[16];		/* IPv4 as ::ffff:a.b.c.d */
+	__u8 daddr[16];
+	__be16 sport;
+	__be16 dport;
+	__u8 family;		/* AF_INET or AF_INET6 */
+	__u8 proto;
+	__u16 caplen;
+	__u32 pattern;		/* first pattern matched */
+	__u32 offset;		/* payload offset just past it */
+	__u32 matches;		/* in this packet */
+	__u8 data[SNIFF_EVENT_SNAPLEN];	/* caplen payload bytes up to offset */
+};
+
+#endif /* __SNIFF_EVENT_H__ */
@@ -0,0 +1,270 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/inet.h>
+#include <linux/bitmap.h>
+#include <linux/string.h>
+#include <linux/seq_file.h>
+#include <linux/netfilter.h>
+
+#include "sniff.h"
+
+#define SNIFF_FILTER_ENTRIES_MAX	4096	/* src + dport lines */
+#define SNIFF_LPM_NODES_MAX		16384	/* 1 KB each */
+
+/* Trie entry: 0 = no prefix below, SNIFF_LPM_MATCH = covered, else a node. */
+#define SNIFF_LPM_MATCH			U32_MAX
+#define SNIFF_LPM_ROOT4			0
+#define SNIFF_LPM_ROOT6			1
+
+struct sniff_prefix {
+	struct in6_addr addr;
+	u8 plen;
+	bool v4;
+};
+
+struct sniff_port_range {
+	u16 lo;
+	u16 hi;
+};
+
+/*
+ * Header-only classification: source prefixes and destination ports.
+ *
+ * Prefixes live in a multibit trie, one address byte per level, with
+ * shorter prefixes expanded over the entries they cover. Only membership
+ * matters, so an entry is either "covered" or the next node, and a lookup
+ * is at most 4 (IPv4) or 16 (IPv6) dependent loads. Ports are a bitmap.
+ */
+struct sniff_filter {
+	bool any_src;
+	bool any_port;
+	u32 (*nodes)[256];
+	unsigned int nnodes;
+	unsigned int nsrc;
+	struct sniff_prefix *src;	/* as written, for reading back */
+	unsigned int nports;
+	struct sniff_port_range *ports;
+	DECLARE_BITMAP(port_map, 65536);
+};
+
+void sniff_filter_free(struct sniff_filter *f)
+{
+	if (!f)
+		return;
+
+	kvfree(f->nodes);
+	kvfree(f->src);
+	kvfree(f->ports);
+	kvfree(f);
+}
+
+static int sniff_lpm_insert(struct sniff_filter *f, unsigned int maxnodes,
+			    const struct sniff_prefix *p)
+{
+	const u8 *addr = p->v4 ? &p->addr.s6_addr[12] : p->addr.s6_addr;
+	unsigned int plen = p->plen, depth = 0, span, base, i;
+	u32 node = p->v4 ? SNIFF_LPM_ROOT4 : SNIFF_LPM_ROOT6;
+
+	while (plen > 8) {
+		u32 *e = &f->nodes[node][addr[depth]];
+
+		// already covered by a shorter prefix
+		if (*e == SNIFF_LPM_MATCH)
+			return 0;
+		if (!*e) {
+			if (f->nnodes >= maxnodes)
+				return -E2BIG;
+			*e = f->nnodes++;
+		}
+		node = *e;
+		depth++;
+		plen -= 8;
+	}
+
+	// the last 0-8 bits cover a run of entries; whatever hung below goes,
+	// and a /0 covers its family's whole root
+	span = 1U << (8 - plen);
+	base = addr[depth] & ~(span - 1);
+	for (i = base; i < base + span; i++)
+		f->nodes[node][i] = SNIFF_LPM_MATCH;
+
+	return 0;
+}
+
+static bool sniff_lpm_lookup(const struct sniff_filter *f, u32 node,
+			     const u8 *addr, unsigned int len)
+{
+	for (unsigned int i = 0; i < len; i++) {
+		u32 e = f->nodes[node][addr[i]];
+
+		if (e == SNIFF_LPM_MATCH)
+			return true;
+		if (!e)
+			return false;
+		node = e;
+	}
+	return false;
+}
+
+/* Called from the hook, before a single payload byte is read. */
+bool sniff_filter_match(const struct sniff_filter *f, const struct sniff_flow_key *key)
+{
+	if (!f->any_port && !test_bit(ntohs(key->dport), f->port_map))
+		return false;
+
+	if (f->any_src)
+		return true;
+	if (key->family == NFPROTO_IPV4)
+		return sniff_lpm_lookup(f, SNIFF_LPM_ROOT4, &key->saddr.s6_addr[12], 4);
+	return sniff_lpm_lookup(f, SNIFF_LPM_ROOT6, key->saddr.s6_addr, 16);
+}
+
+static int sniff_parse_prefix(char *arg, struct sniff_prefix *p)
+{
+	char *slash = strchr(arg, '/');
+	unsigned int max;
+	u8 plen;
+
+	if (slash)
+		*slash++ = '\0';
+
+	memset(p, 0, sizeof(*p));
+	if (in4_pton(arg, -1, &p->addr.s6_addr[12], -1, NULL)) {
+		p->v4 = true;
+		max = 32;
+	} else if (in6_pton(arg, -1, p->addr.s6_addr, -1, NULL)) {
+		max = 128;
+	} else {
+		return -EINVAL;
+	}
+
+	if (!slash)
+		plen = max;
+	else if (kstrtou8(slash, 10, &plen) || plen > max)
+		return -EINVAL;
+	p->plen = plen;
+
+	return 0;
+}
+
+static int sniff_parse_ports(char *arg, struct sniff_port_range *r)
+{
+	char *dash = strchr(arg, '-');
+
+	if (dash)
+		*dash++ = '\0';
+	if (kstrtou16(arg, 10, &r->lo))
+		return -EINVAL;
+	if (!dash)
+		r->hi = r->lo;
+	else if (kstrtou16(dash, 10, &r->hi) || r->hi < r->lo)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * One rule per line, "src <addr>[/<len>]" or "dport <port>[-<port>]".
+ * No src line means any source, no dport line any port. Returns NULL for
+ * a filter that lets everything through. @text is modified in place.
+ */
+struct sniff_filter *sniff_filter_parse(char *text)
+{
+	unsigned int nlines = 1, maxnodes = 2, i;
+	struct sniff_filter *f;
+	char *line;
+	int ret;
+
+	for (line = text; *line; line++)
+		if (*line == '\n')
+			nlines++;
+	if (nlines > SNIFF_FILTER_ENTRIES_MAX)
+		return ERR_PTR(-E2BIG);
+
+	f = kvzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return ERR_PTR(-ENOMEM);
+	f->src = kvmalloc_array(nlines, sizeof(*f->src), GFP_KERNEL);
+	f->ports = kvmalloc_array(nlines, sizeof(*f->ports), GFP_KERNEL);
+	if (!f->src || !f->ports) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	while ((line = strsep(&text, "\n")) != NULL) {
+		char *kw, *arg;
+
+		line = strim(line);
+		if (!*line || *line == '#')
+			continue;
+
+		kw = strsep(&line, " \t");
+		arg = line ? strim(line) : "";
+
+		if (!strcmp(kw, "src")) {
+			ret = sniff_parse_prefix(arg, &f->src[f->nsrc]);
+			if (ret)
+				goto err;
+			// levels below the root, each a new node at worst
+			maxnodes += DIV_ROUND_UP(f->src[f->nsrc].plen, 8);
+			f->nsrc++;
+		} else if (!strcmp(kw, "dport")) {
+			ret = sniff_parse_ports(arg, &f->ports[f->nports]);
+			if (ret)
+				goto err;
+			f->nports++;
+		} else {
+			ret = -EINVAL;
+			goto err;
+		}
+	}
+
+	if (!f->nsrc && !f->nports) {
+		sniff_filter_free(f);
+		return NULL;
+	}
+
+	f->any_src = !f->nsrc;
+	f->any_port = !f->nports;
+	for (i = 0; i < f->nports; i++)
+		bitmap_set(f->port_map, f->ports[i].lo, f->ports[i].hi - f->ports[i].lo + 1);
+
+	maxnodes = min(maxnodes, SNIFF_LPM_NODES_MAX);
+	f->nodes = kvcalloc(maxnodes, sizeof(*f->nodes), GFP_KERNEL);
+	if (!f->nodes) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	f->nnodes = 2;
+	for (i = 0; i < f->nsrc; i++) {
+		ret = sniff_lpm_insert(f, maxnodes, &f->src[i]);
+		if (ret)
+			goto err;
+	}
+
+	return f;
+
+err:
+	sniff_filter_free(f);
+	return ERR_PTR(ret);
+}
+
+void sniff_filter_show(struct seq_file *m, const struct sniff_filter *f)
+{
+	unsigned int i;
+
+	for (i = 0; i < f->nsrc; i++) {
+		if (f->src[i].v4)
+			seq_printf(m, "src %pI4/%u\n", &f->src[i].addr.s6_addr[12], f->src[i].plen);
+		else
+			seq_printf(m, "src %pI6c/%u\n", &f->src[i].addr, f->src[i].plen);
+	}
+	for (i = 0; i < f->nports; i++) {
+		if (f->ports[i].lo == f->ports[i].hi)
+			seq_printf(m, "dport %u\n", f->ports[i].lo);
+		else
+			seq_printf(m, "dport %u-%u\n", f->ports[i].lo, f->ports[i].hi);
+	}
+}
@@ -0,0 +1,180 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/rhashtable.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+
+#include "sniff.h"
+
+#define SNIFF_FLOW_GC_INTERVAL	HZ
+#define SNIFF_FLOW_GC_BATCH	1024	/* entries between reschedule points */
+
+static unsigned int flow_max = 1 << 20;
+module_param(flow_max, uint, 0644);
+MODULE_PARM_DESC(flow_max, "Maximum number of tracked flows (default=1048576)");
+
+static unsigned int flow_timeout = 30;
+module_param(flow_timeout, uint, 0644);
+MODULE_PARM_DESC(flow_timeout, "Seconds an idle flow is kept (default=30)");
+
+static struct kmem_cache *flow_cache;
+static struct rhashtable flow_table;
+static struct delayed_work flow_gc_work;
+
+static const struct rhashtable_params flow_params = {
+	.head_offset = offsetof(struct sniff_flow, node),
+	.key_offset = offsetof(struct sniff_flow, key),
+	.key_len = sizeof(struct sniff_flow_key),
+	.automatic_shrinking = true,
+};
+
+static void sniff_flow_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(flow_cache, container_of(head, struct sniff_flow, rcu));
+}
+
+/*
+ * Look up the flow for @key, creating it if needed. Called from the hook
+ * under rcu_read_lock(); the flow stays valid until rcu_read_unlock().
+ * Returns NULL if the table is full or memory is short; the caller then
+ * scans the packet without flow state.
+ */
+struct sniff_flow *sniff_flow_get(const struct sniff_flow_key *key)
+{
+	struct sniff_flow *flow, *old;
+
+	flow = rhashtable_lookup(&flow_table, key, flow_params);
+	if (likely(flow))
+		goto found;
+
+	if (atomic_read(&flow_table.nelems) >= READ_ONCE(flow_max))
+		return NULL;
+
+	flow = kmem_cache_zalloc(flow_cache, GFP_ATOMIC | __GFP_NOWARN);
+	if (!flow)
+		return NULL;
+	flow->key = *key;
+
+	// another CPU may have raced us to it
+	old = rhashtable_lookup_get_insert_fast(&flow_table, &flow->node, flow_params);
+	if (old) {
+		kmem_cache_free(flow_cache, flow);
+		if (IS_ERR(old))
+			return NULL;
+		flow = old;
+	}
+
+found:
+	if (READ_ONCE(flow->last_seen) != jiffies)
+		WRITE_ONCE(flow->last_seen, jiffies);
+	return flow;
+}
+
+/*
+ * Look up without creating; the same rules as for sniff_flow_get() apply,
+ * and a flow found counts as seen, so the GC leaves it be.
+ */
+struct sniff_flow *sniff_flow_lookup(const struct sniff_flow_key *key)
+{
+	struct sniff_flow *flow;
+
+	flow = rhashtable_lookup(&flow_table, key, flow_params);
+	if (flow && READ_ONCE(flow->last_seen) != jiffies)
+		WRITE_ONCE(flow->last_seen, jiffies);
+	return flow;
+}
+
+/* Drop a flow; safe against a concurrent delete of the same flow. */
+void sniff_flow_del(struct sniff_flow *flow)
+{
+	if (!rhashtable_remove_fast(&flow_table, &flow->node, flow_params))
+		call_rcu(&flow->rcu, sniff_flow_free_rcu);
+}
+
+/* Drop the flow for @key, if there is one. */
+void sniff_flow_forget(const struct sniff_flow_key *key)
+{
+	struct sniff_flow *flow;
+
+	rcu_read_lock();
+	flow = sniff_flow_lookup(key);
+	if (flow)
+		sniff_flow_del(flow);
+	rcu_read_unlock();
+}
+
+unsigned int sniff_flow_count(void)
+{
+	return atomic_read(&flow_table.nelems);
+}
+
+/* Expire idle flows, a batch at a time so the walk can reschedule. */
+static void sniff_flow_gc(struct work_struct *work)
+{
+	unsigned long timeout = (unsigned long)READ_ONCE(flow_timeout) * HZ;
+	struct rhashtable_iter iter;
+	struct sniff_flow *flow;
+	unsigned int n = 0;
+
+	rhashtable_walk_enter(&flow_table, &iter);
+	rhashtable_walk_start(&iter);
+	while ((flow = rhashtable_walk_next(&iter)) != NULL) {
+		if (IS_ERR(flow)) {
+			if (PTR_ERR(flow) == -EAGAIN)
+				continue;
+			break;
+		}
+
+		if (time_after(jiffies, READ_ONCE(flow->last_seen) + timeout))
+			sniff_flow_del(flow);
+
+		if (++n % SNIFF_FLOW_GC_BATCH == 0) {
+			rhashtable_walk_stop(&iter);
+			cond_resched();
+			rhashtable_walk_start(&iter);
+		}
+	}
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+
+	queue_delayed_work(system_power_efficient_wq, &flow_gc_work,
+			   SNIFF_FLOW_GC_INTERVAL);
+}
+
+int sniff_flow_init(void)
+{
+	int ret;
+
+	flow_cache = KMEM_CACHE(sniff_flow, SLAB_HWCACHE_ALIGN);
+	if (!flow_cache)
+		return -ENOMEM;
+
+	ret = rhashtable_init(&flow_table, &flow_params);
+	if (ret) {
+		kmem_cache_destroy(flow_cache);
+		return ret;
+	}
+
+	INIT_DELAYED_WORK(&flow_gc_work, sniff_flow_gc);
+	queue_delayed_work(system_power_efficient_wq, &flow_gc_work,
+			   SNIFF_FLOW_GC_INTERVAL);
+
+	return 0;
+}
+
+static void sniff_flow_free(void *ptr, void *arg)
+{
+	kmem_cache_free(flow_cache, ptr);
+}
+
+/* Called once the hook is unregistered, so nothing adds flows any more. */
+void sniff_flow_exit(void)
+{
+	cancel_delayed_work_sync(&flow_gc_work);
+	rhashtable_free_and_destroy(&flow_table, sniff_flow_free, NULL);
+
+	// wait for flows freed by sniff_flow_del()
+	rcu_barrier();
+	kmem_cache_destroy(flow_cache);
+}
@@ -0,0 +1,266 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bitops.h>
+#include <linux/timex.h>
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#ifdef CONFIG_X86_64
+#include <asm/fpu/api.h>
+#include <asm/cpufeature.h>
+#endif
+
+#include "sniff.h"
+
+/* Below this many bytes saving the FPU state costs more than it buys. */
+#define SNIFF_SIMD_MIN		256
+
+static bool force_scalar;
+module_param(force_scalar, bool, 0644);
+MODULE_PARM_DESC(force_scalar, "Never use SSE2/AVX2 for the payload prefilter (default=0)");
+
+/*
+ * Fill in the SIMD lookup tables once a->map holds the anchor bytes.
+ *
+ * SSE2 compares against each anchor broadcast to a whole register, so it
+ * only handles a handful of them. AVX2 tests membership of any byte set
+ * with two nibble lookups (the "truffle" technique): the low nibble picks
+ * a byte from one of two tables, depending on bit 7, and bits 4-6 pick a
+ * bit within it.
+ */
+void sniff_anchors_init(struct sniff_anchors *a)
+{
+	unsigned int c;
+
+	a->nbytes = 0;
+	memset(a->lo, 0, sizeof(a->lo));
+
+	for (c = 0; c < 256; c++) {
+		if (!a->map[c])
+			continue;
+		if (a->nbytes < ARRAY_SIZE(a->bcast))
+			memset(a->bcast[a->nbytes], c, sizeof(a->bcast[0]));
+		a->nbytes++;
+		a->lo[c >> 7][c & 0xf] |= 1 << ((c >> 4) & 7);
+	}
+
+	// unused SSE2 slots repeat the first anchor
+	for (c = a->nbytes; c < ARRAY_SIZE(a->bcast); c++)
+		memcpy(a->bcast[c], a->bcast[0], sizeof(a->bcast[0]));
+}
+
+static unsigned int sniff_find_scalar(const struct sniff_anchors *a, const u8 *data,
+				      unsigned int i, unsigned int len)
+{
+	for (; i < len; i++)
+		if (a->map[data[i]])
+			break;
+	return i;
+}
+
+#ifdef CONFIG_X86_64
+static const u8 sniff_bits[16] __aligned(16) = {
+	1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+};
+static const u8 sniff_x80 = 0x80, sniff_x07 = 0x07;
+
+/*
+ * The kernel itself never touches vector registers, so, as in lib/raid6,
+ * constants loaded by one asm statement are still there for the next.
+ */
+static unsigned int sniff_find_sse2(const struct sniff_anchors *a, const u8 *data,
+				    unsigned int i, unsigned int len)
+{
+	u32 mask;
+
+	asm volatile("movdqu %0, %%xmm0" : : "m" (a->bcast[0]));
+	asm volatile("movdqu %0, %%xmm1" : : "m" (a->bcast[1]));
+	asm volatile("movdqu %0, %%xmm2" : : "m" (a->bcast[2]));
+	asm volatile("movdqu %0, %%xmm3" : : "m" (a->bcast[3]));
+
+	for (; i + 16 <= len; i += 16) {
+		asm volatile("movdqu %1, %%xmm4\n\t"
+			     "movdqa %%xmm4, %%xmm5\n\t"
+			     "pcmpeqb %%xmm0, %%xmm5\n\t"
+			     "movdqa %%xmm4, %%xmm6\n\t"
+			     "pcmpeqb %%xmm1, %%xmm6\n\t"
+			     "por %%xmm6, %%xmm5\n\t"
+			     "movdqa %%xmm4, %%xmm6\n\t"
+			     "pcmpeqb %%xmm2, %%xmm6\n\t"
+			     "por %%xmm6, %%xmm5\n\t"
+			     "pcmpeqb %%xmm3, %%xmm4\n\t"
+			     "por %%xmm4, %%xmm5\n\t"
+			     "pmovmskb %%xmm5, %0"
+			     : "=r" (mask)
+			     : "m" (*(const u8 (*)[16])(data + i)));
+		if (mask)
+			return i + __ffs(mask);
+	}
+
+	return sniff_find_scalar(a, data, i, len);
+}
+
+static unsigned int sniff_find_avx2(const struct sniff_anchors *a, const u8 *data,
+				    unsigned int i, unsigned int len)
+{
+	u32 mask;
+
+	asm volatile("vbroadcasti128 %0, %%ymm0" : : "m" (a->lo[0]));
+	asm volatile("vbroadcasti128 %0, %%ymm1" : : "m" (a->lo[1]));
+	asm volatile("vbroadcasti128 %0, %%ymm2" : : "m" (sniff_bits));
+	asm volatile("vpbroadcastb %0, %%ymm3" : : "m" (sniff_x80));
+	asm volatile("vpbroadcastb %0, %%ymm4" : : "m" (sniff_x07));
+
+	for (; i + 32 <= len; i += 32) {
+		asm volatile("vmovdqu %1, %%ymm5\n\t"
+			     /* bit 7 clear: table 0; vpshufb zeroes the rest */
+			     "vpshufb %%ymm5, %%ymm0, %%ymm6\n\t"
+			     /* bit 7 set: flip it and use table 1 */
+			     "vpxor %%ymm3, %%ymm5, %%ymm7\n\t"
+			     "vpshufb %%ymm7, %%ymm1, %%ymm7\n\t"
+			     "vpor %%ymm7, %%ymm6, %%ymm6\n\t"
+			     /* 1 << ((c >> 4) & 7) */
+			     "vpsrlw $4, %%ymm5, %%ymm7\n\t"
+			     "vpand %%ymm4, %%ymm7, %%ymm7\n\t"
+			     "vpshufb %%ymm7, %%ymm2, %%ymm7\n\t"
+			     "vpand %%ymm7, %%ymm6, %%ymm6\n\t"
+			     "vpcmpeqb %%ymm7, %%ymm6, %%ymm6\n\t"
+			     "vpmovmskb %%ymm6, %0"
+			     : "=r" (mask)
+			     : "m" (*(const u8 (*)[32])(data + i)));
+		if (mask)
+			return i + __ffs(mask);
+	}
+
+	return sniff_find_scalar(a, data, i, len);
+}
+
+/* The CPU has AVX2 and the kernel saves and restores the YMM state. */
+static bool sniff_simd_has_avx2(void)
+{
+	return boot_cpu_has(X86_FEATURE_AVX2) &&
+	       cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
+}
+
+static enum sniff_simd sniff_simd_pick(const struct sniff_anchors *a)
+{
+	if (sniff_simd_has_avx2())
+		return SNIFF_SIMD_AVX2;
+	if (a->nbytes <= ARRAY_SIZE(a->bcast))
+		return SNIFF_SIMD_SSE2;
+	return SNIFF_SIMD_NONE;
+}
+
+/*
+ * Choose how to search @len bytes for anchors and, for the vector paths,
+ * enter a kernel FPU section that sniff_simd_end() leaves.
+ */
+enum sniff_simd sniff_simd_begin(const struct sniff_anchors *a, unsigned int len)
+{
+	enum sniff_simd simd;
+
+	if (READ_ONCE(force_scalar) || len < SNIFF_SIMD_MIN || !irq_fpu_usable())
+		return SNIFF_SIMD_NONE;
+
+	simd = sniff_simd_pick(a);
+	if (simd != SNIFF_SIMD_NONE)
+		kernel_fpu_begin();
+	return simd;
+}
+
+void sniff_simd_end(enum sniff_simd simd)
+{
+	if (simd != SNIFF_SIMD_NONE)
+		kernel_fpu_end();
+}
+#else
+enum sniff_simd sniff_simd_begin(const struct sniff_anchors *a, unsigned int len)
+{
+	return SNIFF_SIMD_NONE;
+}
+
+void sniff_simd_end(enum sniff_simd simd)
+{
+}
+#endif /* CONFIG_X86_64 */
+
+/* Offset of the first anchor byte in data[i..len), or len if there is none. */
+unsigned int sniff_find_anchor(const struct sniff_anchors *a, enum sniff_simd simd,
+			       const u8 *data, unsigned int i, unsigned int len)
+{
+#ifdef CONFIG_X86_64
+	if (simd == SNIFF_SIMD_AVX2)
+		return sniff_find_avx2(a, data, i, len);
+	if (simd == SNIFF_SIMD_SSE2)
+		return sniff_find_sse2(a, data, i, len);
+#endif
+	return sniff_find_scalar(a, data, i, len);
+}
+
+#define SNIFF_BENCH_LEN		(64 << 10)
+#define SNIFF_BENCH_LOOPS	64
+
+static void sniff_bench_one(const char *name, const struct sniff_anchors *a,
+			    enum sniff_simd simd, const u8 *buf)
+{
+	u64 bytes = (u64)SNIFF_BENCH_LEN * SNIFF_BENCH_LOOPS;
+	unsigned int found = 0;
+	cycles_t t0, t1;
+
+	t0 = get_cycles();
+	for (int i = 0; i < SNIFF_BENCH_LOOPS; i++) {
+#ifdef CONFIG_X86_64
+		if (simd != SNIFF_SIMD_NONE)
+			kernel_fpu_begin();
+#endif
+		found += sniff_find_anchor(a, simd, buf, 0, SNIFF_BENCH_LEN);
+#ifdef CONFIG_X86_64
+		if (simd != SNIFF_SIMD_NONE)
+			kernel_fpu_end();
+#endif
+		cond_resched();
+	}
+	t1 = get_cycles();
+
+	if (t1 == t0 || found != SNIFF_BENCH_LEN * SNIFF_BENCH_LOOPS) {
+		pr_info("prefilter bench %s: no result\n", name);
+		return;
+	}
+	pr_info("prefilter bench %s: %llu.%02llu bytes/cycle\n", name,
+		div64_u64(bytes, t1 - t0), div64_u64(bytes * 100, t1 - t0) % 100);
+}
+
+/*
+ * Microbenchmark of the anchor search alone: a buffer with no anchor byte
+ * is the worst case, every byte has to be looked at.
+ */
+void sniff_simd_bench(void)
+{
+	struct sniff_anchors *a;
+	u8 *buf;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	buf = kvmalloc(SNIFF_BENCH_LEN, GFP_KERNEL);
+	if (!a || !buf)
+		goto out;
+
+	// four anchors, so every implementation applies
+	a->map['<'] = a->map['%'] = a->map[0x90] = a->map[0xcc] = 1;
+	sniff_anchors_init(a);
+
+	get_random_bytes(buf, SNIFF_BENCH_LEN);
+	for (int i = 0; i < SNIFF_BENCH_LEN; i++)
+		if (a->map[buf[i]])
+			buf[i] = 'a';
+
+	sniff_bench_one("scalar", a, SNIFF_SIMD_NONE, buf);
+#ifdef CONFIG_X86_64
+	sniff_bench_one("sse2", a, SNIFF_SIMD_SSE2, buf);
+	if (sniff_simd_has_avx2())
+		sniff_bench_one("avx2", a, SNIFF_SIMD_AVX2, buf);
+#endif
+
+out:
+	kvfree(buf);
+	kfree(a);
+}
@@ -0,0 +1,32 @@
+#ifndef __SNIFF_XDP_H__
+#define __SNIFF_XDP_H__
+
+/*
+ * Shared by the module and xdp/sniff_xdp.bpf.c. The XDP program leaves its
+ * verdict in the packet's metadata area, right in front of the MAC header,
+ * where the stack keeps it for the skb; with xdp_meta=1 the hook reads it
+ * before anything else.
+ */
+
+#include <linux/types.h>
+
+#define SNIFF_XDP_MAGIC		0x534e4946	/* "SNIF" */
+
+enum {
+	SNIFF_XDP_INSPECT = 1,
+	SNIFF_XDP_SKIP = 2,
+};
+
+struct sniff_xdp_meta {
+	__u32 magic;
+	__u32 verdict;
+};
+
+/* The one entry of the sniff_config map; all zero inspects everything */
+struct sniff_xdp_config {
+	__u32 filter_src;	/* only sources in sniff_src4/sniff_src6 */
+	__u32 filter_port;	/* only destination ports set in sniff_ports */
+	__u32 sample;		/* then 1 in N of those, 0 or 1 for all */
+};
+
+#endif /* __SNIFF_XDP_H__ */
@@ -0,0 +1,157 @@
+/*
+ * XDP front end for the sniffer: header-only classification at the driver,
+ * before an skb even exists. Every TCP/UDP packet is tagged with a verdict
+ * in its metadata; the netfilter hook, loaded with xdp_meta=1, returns at
+ * once for packets tagged SNIFF_XDP_SKIP. Packets this program cannot
+ * classify, and all packets on drivers without metadata support, go
+ * through untagged and are classified by the hook as before.
+ *
+ *   ip link set dev <dev> xdp obj sniff_xdp.bpf.o sec xdp
+ */
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../sniff_xdp.h"
+
+#define SNIFF_XDP_PREFIXES	4096
+
+struct sniff_lpm4 {
+	__u32 prefixlen;
+	__u8 addr[4];
+};
+
+struct sniff_lpm6 {
+	__u32 prefixlen;
+	__u8 addr[16];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, SNIFF_XDP_PREFIXES);
+	__type(key, struct sniff_lpm4);
+	__type(value, __u8);
+} sniff_src4 SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, SNIFF_XDP_PREFIXES);
+	__type(key, struct sniff_lpm6);
+	__type(value, __u8);
+} sniff_src6 SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 65536);
+	__type(key, __u32);
+	__type(value, __u8);
+} sniff_ports SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct sniff_xdp_config);
+} sniff_config SEC(".maps");
+
+static __always_inline __u32 sniff_classify(__u16 dport, void *src_map, const void *src_key)
+{
+	const struct sniff_xdp_config *cfg;
+	__u32 key = 0;
+	__u8 *port;
+
+	cfg = bpf_map_lookup_elem(&sniff_config, &key);
+	if (!cfg)
+		return SNIFF_XDP_INSPECT;
+
+	if (cfg->filter_port) {
+		key = dport;
+		port = bpf_map_lookup_elem(&sniff_ports, &key);
+		if (!port || !*port)
+			return SNIFF_XDP_SKIP;
+	}
+
+	if (cfg->filter_src && !bpf_map_lookup_elem(src_map, src_key))
+		return SNIFF_XDP_SKIP;
+
+	if (cfg->sample > 1 && bpf_get_prandom_u32() % cfg->sample)
+		return SNIFF_XDP_SKIP;
+
+	return SNIFF_XDP_INSPECT;
+}
+
+SEC("xdp")
+int sniff_xdp(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *end = (void *)(long)ctx->data_end;
+	struct ethhdr *eth = data;
+	struct sniff_xdp_meta *meta;
+	struct sniff_lpm4 key4;
+	struct sniff_lpm6 key6;
+	__be16 *ports;
+	__u32 verdict;
+
+	if ((void *)(eth + 1) > end)
+		return XDP_PASS;
+
+	if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+		struct iphdr *iph = (void *)(eth + 1);
+
+		if ((void *)(iph + 1) > end)
+			return XDP_PASS;
+		if (iph->protocol != IPPROTO_TCP && iph->protocol != IPPROTO_UDP)
+			return XDP_PASS;
+		// only the first fragment has ports
+		if (iph->frag_off & bpf_htons(0x1fff))
+			return XDP_PASS;
+
+		// TCP and UDP both start with source and destination port
+		ports = (void *)iph + iph->ihl * 4;
+		if ((void *)(ports + 2) > end)
+			return XDP_PASS;
+
+		key4.prefixlen = 32;
+		__builtin_memcpy(key4.addr, &iph->saddr, sizeof(key4.addr));
+		verdict = sniff_classify(bpf_ntohs(ports[1]), &sniff_src4, &key4);
+	} else if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr *ip6h = (void *)(eth + 1);
+
+		if ((void *)(ip6h + 1) > end)
+			return XDP_PASS;
+		// extension headers are left to the hook
+		if (ip6h->nexthdr != IPPROTO_TCP && ip6h->nexthdr != IPPROTO_UDP)
+			return XDP_PASS;
+
+		ports = (void *)(ip6h + 1);
+		if ((void *)(ports + 2) > end)
+			return XDP_PASS;
+
+		key6.prefixlen = 128;
+		__builtin_memcpy(key6.addr, &ip6h->saddr, sizeof(key6.addr));
+		verdict = sniff_classify(bpf_ntohs(ports[1]), &sniff_src6, &key6);
+	} else {
+		return XDP_PASS;
+	}
+
+	if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*meta)))
+		return XDP_PASS;
+
+	data = (void *)(long)ctx->data;
+	meta = (void *)(long)ctx->data_meta;
+	if ((void *)(meta + 1) > data)
+		return XDP_PASS;
+
+	meta->magic = SNIFF_XDP_MAGIC;
+	meta->verdict = verdict;
+
+	return XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
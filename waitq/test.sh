@@ -3,3 +3,6 @@ echo -n "Bob" > /dev/eudyptula
 sleep 5
 echo -n "Dave" > /dev/eudyptula
 echo -n "Gena" > /dev/eudyptula
+printf "Erin\nFrank\nGrace\n" > /dev/eudyptula
+sleep 5
+cat /sys/kernel/debug/waitq/stats
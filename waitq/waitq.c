@@ -9,95 +9,347 @@
 #include <linux/delay.h>
 #include <linux/mutex.h>
 #include <linux/atomic.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
+#include <linux/string.h>
+#include <linux/llist.h>
+#include <linux/uio.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/rbtree.h>
+#include <linux/bitops.h>
+#include <linux/rhashtable.h>
+#include <linux/rcupdate.h>
 
-#define NAME_LEN 20
+#include "waitq.h"
+
+#define NAME_LEN WAITQ_NAME_LEN
+
+static unsigned int workers = 1;
+module_param(workers, uint, 0444);
+MODULE_PARM_DESC(workers, "Consumer threads bound to each online CPU (default=1)");
+
+static unsigned int work_us = 2000000;
+module_param(work_us, uint, 0644);
+MODULE_PARM_DESC(work_us, "Simulated cost of handling one identity, in microseconds (default=2000000)");
+
+static unsigned int cq_entries = 256;
+module_param(cq_entries, uint, 0644);
+MODULE_PARM_DESC(cq_entries, "Completions kept per open file for read(), rounded up to a power of 2 (default=256)");
+
+static unsigned int max_depth = 4096;
+module_param(max_depth, uint, 0644);
+MODULE_PARM_DESC(max_depth, "Submitted identities queued or being handled before writers wait, 0 for no limit (default=4096)");
 
 static struct drv_ctx {
 	struct device *dev;
 	struct kmem_cache *mem_cache;
-	struct task_struct *waitq_task;
+	int hp_state;			/* cpuhp state starting the workers */
+	unsigned int nr_workers;	/* on online CPUs */
 	struct list_head head_node;
+	struct rhashtable id_index;	/* the same identities, by id */
 	struct mutex list_mtx;
-	wait_queue_head_t wee_wait;
+	atomic_t idle;			/* workers asleep or about to be */
+	cpumask_t idle_cpus;		/* with a worker asleep, a hint */
+	atomic_t depth;			/* submitted, not yet handled */
+	u32 high_water;			/* deepest depth seen */
+	wait_queue_head_t space_wait;	/* writers waiting for depth to drop */
+	struct dentry *dbg;
+	struct list_head rings;		/* files with submission rings */
+	struct mutex ring_mtx;
 	atomic_t cnt;
-	atomic_t data_ready;
 } *ctx;
 
+/*
+ * An open /dev/eudyptula. Every identity written through it holds a
+ * reference, so completions can still be posted after close().
+ */
+struct waitq_file {
+	struct kref ref;
+	spinlock_t cq_lock;		/* workers posting */
+	struct mutex read_mtx;		/* readers taking */
+	DECLARE_KFIFO_PTR(cq, struct waitq_cqe);
+	wait_queue_head_t wait;
+	unsigned long overflow;		/* completions lost to a full cq */
+
+	/* Shared with userspace after WAITQ_IOC_SETUP, see waitq.h. */
+	struct waitq_rings *rings;
+	struct waitq_sqe *sqes;
+	struct waitq_cqe *cqes;
+	u32 sq_mask, cq_mask;
+	u32 sq_head;			/* under sq_mtx */
+	u32 cq_tail;			/* under cq_lock */
+	struct mutex sq_mtx;
+	struct list_head ring_node;	/* on ctx->rings */
+
+	/* WAITQ_IOC_SET_CLASS, for write() */
+	u32 prio;
+	u32 deadline_us;
+};
+
 struct identity {
 	struct list_head list;
+	struct rhash_head hnode;
+	struct kref ref;		/* one for the store, one per finder */
+	struct rcu_head rcu;
+	struct llist_node node;
+	union {
+		struct list_head sched_list;	/* on its class's fifo */
+		struct rb_node sched_node;	/* or on its deadline tree */
+	};
+	struct waitq_file *owner;	/* NULL unless written by userspace */
+	u64 t_enq, t_deq, t_done;	/* ktime_get_ns() */
+	u64 deadline;			/* absolute, 0 for none */
+	u32 deadline_us;
+	u8 prio;
 	char name[NAME_LEN];
 	int  id;
 	bool busy;
 };
 
-static int identity_create(const char *name, int id)
+/*
+ * Where submissions spend their time: queued, from submission until a
+ * worker takes them up, in the handler, and the two together. Bucket 0 is
+ * under 1us, bucket n from 2^(n-1) up to 2^n us.
+ */
+#define NR_LAT	32
+
+enum { LAT_QUEUE, LAT_SERVICE, LAT_TOTAL, NR_STAGES };
+
+static const char * const lat_stage[NR_STAGES] = { "queue", "service", "total" };
+
+struct waitq_stats {
+	u64 submitted;
+	u64 completed;
+	u64 missed;			/* done past their deadline */
+	u64 local;			/* taken from this CPU's queue */
+	u64 stolen;			/* from another CPU's */
+	u64 lat[NR_STAGES][NR_LAT];
+};
+
+static DEFINE_PER_CPU(struct waitq_stats, waitq_stats);
+
+/*
+ * Submissions queue on the CPU they are made on, for the workers bound to
+ * it. Workers with nothing of their own take from other CPUs.
+ */
+struct waitq_cpu {
+	struct llist_head subq;		/* submitted, not yet handled */
+	struct {
+		spinlock_t lock;
+		struct {
+			struct rb_root_cached deadline;	/* by absolute deadline */
+			struct list_head fifo;		/* no deadline, in order */
+		} prio[WAITQ_NR_PRIO];			/* class 0 first */
+		unsigned long busy;			/* non-empty classes */
+		unsigned int nr;
+	} sched;			/* taken off subq, not yet handled */
+	struct task_struct **workers;	/* bound here, while online */
+	wait_queue_head_t wait;		/* this CPU's workers */
+	atomic_t idle;			/* of them, asleep */
+	bool kick;			/* wake one to look elsewhere */
+};
+
+static DEFINE_PER_CPU(struct waitq_cpu, waitq_cpu);
+
+static const struct rhashtable_params id_params = {
+	.key_len = sizeof(int),
+	.key_offset = offsetof(struct identity, id),
+	.head_offset = offsetof(struct identity, hnode),
+	.automatic_shrinking = true,
+};
+
+static void waitq_file_free(struct kref *ref)
+{
+	struct waitq_file *wf = container_of(ref, struct waitq_file, ref);
+
+	if (wf->overflow)
+		dev_dbg(ctx->dev, "%lu completions lost\n", wf->overflow);
+	kfifo_free(&wf->cq);
+	vfree(wf->rings);
+	kfree(wf);
+}
+
+/* Tell the writer, if any, how it went. */
+static void identity_complete(struct identity *idnt, int status, u64 time_ns)
+{
+	struct waitq_file *wf = idnt->owner;
+	struct waitq_cqe cqe = {
+		.id = idnt->id,
+		.status = status,
+		.time_ns = time_ns,
+	};
+
+	if (!wf)
+		return;
+
+	memcpy(cqe.name, idnt->name, NAME_LEN);
+
+	spin_lock(&wf->cq_lock);
+	if (wf->rings) {
+		if (wf->cq_tail - READ_ONCE(wf->rings->cq_head) > wf->cq_mask) {
+			WRITE_ONCE(wf->rings->cq_overflow, ++wf->overflow);
+		} else {
+			wf->cqes[wf->cq_tail & wf->cq_mask] = cqe;
+			smp_store_release(&wf->rings->cq_tail, ++wf->cq_tail);
+		}
+	} else if (!kfifo_put(&wf->cq, cqe)) {
+		wf->overflow++;
+	}
+	spin_unlock(&wf->cq_lock);
+
+	if (wq_has_sleeper(&wf->wait))
+		wake_up_interruptible_poll(&wf->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+static void identity_free(struct identity *idnt)
+{
+	if (idnt->owner)
+		kref_put(&idnt->owner->ref, waitq_file_free);
+	kmem_cache_free(ctx->mem_cache, idnt);
+}
+
+/* Take a slot in the queue for one submission, unless max_depth are taken. */
+static bool depth_get(void)
+{
+	unsigned int max = READ_ONCE(max_depth);
+	int d = atomic_read(&ctx->depth);
+	u32 hw;
+
+	do {
+		if (max && d >= max)
+			return false;
+	} while (!atomic_try_cmpxchg(&ctx->depth, &d, d + 1));
+
+	hw = READ_ONCE(ctx->high_water);
+	while (d + 1 > hw && !try_cmpxchg(&ctx->high_water, &hw, d + 1))
+		;
+
+	return true;
+}
+
+static bool depth_full(void)
+{
+	unsigned int max = READ_ONCE(max_depth);
+
+	return max && atomic_read(&ctx->depth) >= max;
+}
+
+static void depth_put(void)
 {
-	struct identity *tmp = NULL;
+	atomic_dec(&ctx->depth);
+	if (wq_has_sleeper(&ctx->space_wait))
+		wake_up_interruptible_poll(&ctx->space_wait, EPOLLOUT | EPOLLWRNORM);
+}
+
+static struct identity *identity_alloc(const char *name, int id)
+{
+	struct identity *tmp;
 
 	tmp = kmem_cache_alloc(ctx->mem_cache, GFP_KERNEL);
 	if (unlikely(!tmp))
-		return -ENOMEM;
+		return NULL;
 
 	strscpy(tmp->name, name, NAME_LEN - 1);
 	tmp->id = id;
 	tmp->busy = false;
+	kref_init(&tmp->ref);
+	tmp->owner = NULL;
+	tmp->prio = WAITQ_PRIO_DEFAULT;
+	tmp->deadline_us = 0;
 
-	mutex_lock(&ctx->list_mtx);
-	INIT_LIST_HEAD(&tmp->list);
-	list_add_tail(&tmp->list, &ctx->head_node);
-	mutex_unlock(&ctx->list_mtx);
+	return tmp;
+}
+
+static void identity_free_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(ctx->mem_cache, container_of(rcu, struct identity, rcu));
+}
 
-	dev_info(ctx->dev, "Added node %s to the list\n", tmp->name);
+/* The last reference is gone; readers may still be looking, free it after them. */
+static void identity_release(struct kref *ref)
+{
+	struct identity *idnt = container_of(ref, struct identity, ref);
 
-	return 0;
+	call_rcu(&idnt->rcu, identity_free_rcu);
 }
 
-static struct identity *identity_find(int id)
+static void identity_put(struct identity *idnt)
+{
+	kref_put(&idnt->ref, identity_release);
+}
+
+static int identity_create(const char *name, int id)
 {
-	struct identity *curr, *found = NULL;
+	struct identity *tmp = identity_alloc(name, id);
+	int ret;
+
+	if (unlikely(!tmp))
+		return -ENOMEM;
 
+	/* The list keeps the order, the index finds by id. */
 	mutex_lock(&ctx->list_mtx);
-	list_for_each_entry(curr, &ctx->head_node, list) {
-		if (curr->id == id) {
-			found = curr;
-			break;
-		}
+	ret = rhashtable_lookup_insert_fast(&ctx->id_index, &tmp->hnode, id_params);
+	if (!ret) {
+		list_add_tail(&tmp->list, &ctx->head_node);
+		// the store holds the only reference: after the unlock a
+		// concurrent identity_destroy() may free it, so log it here
+		dev_info(ctx->dev, "Added node %s to the list\n", tmp->name);
 	}
 	mutex_unlock(&ctx->list_mtx);
 
-	return found;
+	if (ret) {
+		dev_dbg(ctx->dev, "Could not add %d: %d\n", id, ret);
+		kmem_cache_free(ctx->mem_cache, tmp);
+		return ret;
+	}
+
+	return 0;
 }
 
-static struct identity *identity_get(void)
+/*
+ * Lock-free: lookups only take a reference, which the caller drops with
+ * identity_put(). One being destroyed meanwhile is not found.
+ */
+static struct identity *identity_find(int id)
 {
-	struct identity *ret;
+	struct identity *found;
 
-	mutex_lock(&ctx->list_mtx);
-	ret = list_first_entry_or_null(&ctx->head_node, struct identity, list);
-	if (ret)
-		list_del(&ret->list);
-	mutex_unlock(&ctx->list_mtx);
+	rcu_read_lock();
+	found = rhashtable_lookup(&ctx->id_index, &id, id_params);
+	if (found && !kref_get_unless_zero(&found->ref))
+		found = NULL;
+	rcu_read_unlock();
 
-	return ret;
+	return found;
 }
 
 static void identity_destroy(int id)
 {
-	struct identity *curr, *tmp, *found = NULL;
+	struct identity *found;
 
 	mutex_lock(&ctx->list_mtx);
-	list_for_each_entry_safe(curr, tmp, &ctx->head_node, list) {
-		if (curr->id == id) {
-			found = curr;
-			list_del(&curr->list);
-			break;
-		}
+	found = rhashtable_lookup_fast(&ctx->id_index, &id, id_params);
+	if (found) {
+		rhashtable_remove_fast(&ctx->id_index, &found->hnode, id_params);
+		list_del(&found->list);
 	}
 	mutex_unlock(&ctx->list_mtx);
 
 	if (found) {
 		dev_dbg(ctx->dev, "Destroyed %d\n", found->id);
-		kmem_cache_free(ctx->mem_cache, found);
+		identity_put(found);
 	} else {
 		dev_dbg(ctx->dev, "Tried to destroy %d but not found\n", id);
 	}
@@ -109,90 +361,918 @@ static void list_destroy(void)
 
 	mutex_lock(&ctx->list_mtx);
 	list_for_each_entry_safe(curr, tmp, &ctx->head_node, list) {
+		rhashtable_remove_fast(&ctx->id_index, &curr->hnode, id_params);
 		list_del(&curr->list);
-		kmem_cache_free(ctx->mem_cache, curr);
+		identity_put(curr);
 	}
 	mutex_unlock(&ctx->list_mtx);
 }
 
+/*
+ * Have a worker look at q: one of its own if any is asleep, else one
+ * asleep on some other CPU, to steal from it.
+ */
+static void waitq_kick(struct waitq_cpu *q)
+{
+	struct waitq_cpu *other;
+	unsigned int cpu;
+
+	if (atomic_read(&q->idle)) {
+		wake_up_interruptible(&q->wait);
+		return;
+	}
+
+	cpu = cpumask_first(&ctx->idle_cpus);
+	if (cpu >= nr_cpu_ids)
+		return;		// all busy, they steal before sleeping
+
+	other = per_cpu_ptr(&waitq_cpu, cpu);
+	WRITE_ONCE(other->kick, true);
+	wake_up_interruptible(&other->wait);
+}
+
+/*
+ * Queue a chain of identities, first to last, for the workers, on this
+ * CPU. Lock-free, any number of writers may push at once. Only the write
+ * that finds the queue empty wakes a worker, later ones join the batch
+ * that worker is about to take.
+ */
+static void identity_submit(struct llist_node *first, struct llist_node *last)
+{
+	struct waitq_cpu *q = raw_cpu_ptr(&waitq_cpu);
+	u64 now = ktime_get_ns();
+	struct identity *idnt;
+	unsigned int n = 0;
+
+	// the chain is still ours until it is added
+	llist_for_each_entry(idnt, first, node) {
+		idnt->t_enq = now;
+		idnt->deadline = idnt->deadline_us ?
+				 now + (u64)idnt->deadline_us * NSEC_PER_USEC : 0;
+		n++;
+	}
+	this_cpu_add(waitq_stats.submitted, n);
+
+	// migrating meanwhile only makes it another CPU's queue
+	if (llist_add_batch(first, last, &q->subq))
+		waitq_kick(q);
+}
+
+static bool deadline_less(struct rb_node *a, const struct rb_node *b)
+{
+	return rb_entry(a, struct identity, sched_node)->deadline <
+	       rb_entry(b, struct identity, sched_node)->deadline;
+}
+
+/*
+ * Move everything submitted to q so far over to its scheduler, into its
+ * class: on the class's tree by deadline if it has one, else on the
+ * class's fifo. Equal deadlines keep their order. Any worker may do this
+ * for any CPU.
+ */
+static void sched_pull(struct waitq_cpu *q)
+{
+	struct identity *idnt, *tmp;
+	struct llist_node *batch;
+
+	if (llist_empty(&q->subq))
+		return;
+
+	// take every queued identity at once, oldest first; under the lock,
+	// so two pullers cannot insert their batches out of order
+	spin_lock(&q->sched.lock);
+	batch = llist_reverse_order(llist_del_all(&q->subq));
+	llist_for_each_entry_safe(idnt, tmp, batch, node) {
+		if (idnt->deadline)
+			rb_add_cached(&idnt->sched_node, &q->sched.prio[idnt->prio].deadline,
+				      deadline_less);
+		else
+			list_add_tail(&idnt->sched_list, &q->sched.prio[idnt->prio].fifo);
+		__set_bit(idnt->prio, &q->sched.busy);
+		q->sched.nr++;
+	}
+	spin_unlock(&q->sched.lock);
+}
+
+/*
+ * The next identity to handle on q: from the best class with work, its
+ * earliest deadline, else the oldest without one.
+ */
+static struct identity *sched_pop(struct waitq_cpu *q)
+{
+	struct identity *idnt = NULL;
+	struct rb_node *rb;
+	unsigned int p;
+
+	spin_lock(&q->sched.lock);
+	p = find_first_bit(&q->sched.busy, WAITQ_NR_PRIO);
+	if (p < WAITQ_NR_PRIO) {
+		rb = rb_first_cached(&q->sched.prio[p].deadline);
+		if (rb) {
+			idnt = rb_entry(rb, struct identity, sched_node);
+			rb_erase_cached(rb, &q->sched.prio[p].deadline);
+		} else {
+			idnt = list_first_entry(&q->sched.prio[p].fifo, struct identity,
+						sched_list);
+			list_del(&idnt->sched_list);
+		}
+		if (RB_EMPTY_ROOT(&q->sched.prio[p].deadline.rb_root) &&
+		    list_empty(&q->sched.prio[p].fifo))
+			__clear_bit(p, &q->sched.busy);
+		q->sched.nr--;
+	}
+	spin_unlock(&q->sched.lock);
+
+	return idnt;
+}
+
+static bool sched_pending(struct waitq_cpu *q)
+{
+	return !llist_empty(&q->subq) || READ_ONCE(q->sched.nr);
+}
+
+static struct identity *sched_take(struct waitq_cpu *q)
+{
+	struct identity *idnt;
+
+	sched_pull(q);
+	idnt = sched_pop(q);
+
+	// a batch wakes one worker, who passes it on while there is more
+	if (idnt && sched_pending(q))
+		waitq_kick(q);
+
+	return idnt;
+}
+
+/*
+ * Next identity for a worker on cpu: from its own queue, else from the
+ * others', starting with the next CPU so thieves spread out.
+ */
+static struct identity *waitq_next(unsigned int cpu)
+{
+	struct identity *idnt;
+
+	idnt = sched_take(per_cpu_ptr(&waitq_cpu, cpu));
+	if (idnt) {
+		this_cpu_inc(waitq_stats.local);
+		return idnt;
+	}
+
+	for (unsigned int i = 1; i < nr_cpu_ids; i++) {
+		unsigned int victim = (cpu + i) % nr_cpu_ids;
+		struct waitq_cpu *q;
+
+		if (!cpu_possible(victim))
+			continue;
+		q = per_cpu_ptr(&waitq_cpu, victim);
+		if (!sched_pending(q))
+			continue;
+
+		idnt = sched_take(q);
+		if (idnt) {
+			this_cpu_inc(waitq_stats.stolen);
+			return idnt;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Turn what userspace put on a file's submission ring into identities and
+ * queue them. Called with sq_mtx held. Returns how many were taken.
+ */
+static unsigned int ring_harvest(struct waitq_file *wf)
+{
+	struct llist_node *first = NULL, *last = NULL;
+	struct waitq_rings *r = wf->rings;
+	u32 head = wf->sq_head;
+	u32 tail = smp_load_acquire(&r->sq_tail);
+	unsigned int n = 0;
+
+	// userspace may have written anything there
+	if (tail - head > wf->sq_mask + 1)
+		tail = head + wf->sq_mask + 1;
+
+	for (; head != tail; head++) {
+		const struct waitq_sqe *sqe;
+		struct identity *idnt;
+
+		// the rest waits on the ring until the workers catch up
+		if (!depth_get())
+			break;
+
+		idnt = identity_alloc("", 0);
+		if (unlikely(!idnt)) {
+			depth_put();
+			break;
+		}
+
+		sqe = &wf->sqes[head & wf->sq_mask];
+		memcpy(idnt->name, sqe->name, NAME_LEN);
+		idnt->name[NAME_LEN - 1] = '\0';
+		if (!idnt->name[0]) {
+			kmem_cache_free(ctx->mem_cache, idnt);
+			depth_put();
+			continue;
+		}
+		idnt->id = atomic_fetch_add(1, &ctx->cnt);
+		if (READ_ONCE(sqe->flags) & WAITQ_SQE_CLASS) {
+			idnt->prio = min_t(u8, READ_ONCE(sqe->prio), WAITQ_NR_PRIO - 1);
+			idnt->deadline_us = READ_ONCE(sqe->deadline_us);
+		} else {
+			idnt->prio = READ_ONCE(wf->prio);
+			idnt->deadline_us = READ_ONCE(wf->deadline_us);
+		}
+		idnt->owner = wf;
+		kref_get(&wf->ref);
+
+		idnt->node.next = NULL;
+		if (last)
+			last->next = &idnt->node;
+		else
+			first = &idnt->node;
+		last = &idnt->node;
+		n++;
+	}
+
+	WRITE_ONCE(wf->sq_head, head);
+	smp_store_release(&r->sq_head, head);
+
+	if (first) {
+		WRITE_ONCE(r->flags, 0);
+		identity_submit(first, last);
+	}
+
+	return n;
+}
+
+/*
+ * Look for submissions on every ring. A busy worker does so between items
+ * and gives up on anything someone else holds. The last worker to go idle
+ * first asks for doorbells, then looks again, waiting for the locks, so a
+ * submission either is seen here or sees WAITQ_SQ_NEED_WAKEUP.
+ */
+static void rings_harvest(bool idle)
+{
+	struct waitq_file *wf;
+
+	if (list_empty(&ctx->rings))
+		return;
+
+	if (idle)
+		mutex_lock(&ctx->ring_mtx);
+	else if (!mutex_trylock(&ctx->ring_mtx))
+		return;
+
+	if (idle) {
+		list_for_each_entry(wf, &ctx->rings, ring_node)
+			WRITE_ONCE(wf->rings->flags, WAITQ_SQ_NEED_WAKEUP);
+		smp_mb();
+	}
+
+	list_for_each_entry(wf, &ctx->rings, ring_node) {
+		if (READ_ONCE(wf->rings->sq_tail) == READ_ONCE(wf->sq_head))
+			continue;
+
+		if (idle)
+			mutex_lock(&wf->sq_mtx);
+		else if (!mutex_trylock(&wf->sq_mtx))
+			continue;
+		ring_harvest(wf);
+		mutex_unlock(&wf->sq_mtx);
+	}
+
+	mutex_unlock(&ctx->ring_mtx);
+}
+
+static long ring_setup(struct waitq_file *wf, struct waitq_ring_params __user *up)
+{
+	struct waitq_ring_params p;
+	struct waitq_rings *r;
+	size_t sq_off, cq_off, size;
+	u32 sq, cq;
+
+	if (copy_from_user(&p, up, sizeof(p)))
+		return -EFAULT;
+	if (!p.sq_entries || p.sq_entries > 1U << 16 ||
+	    !p.cq_entries || p.cq_entries > 1U << 16)
+		return -EINVAL;
+
+	sq = roundup_pow_of_two(p.sq_entries);
+	cq = roundup_pow_of_two(p.cq_entries);
+	sq_off = PAGE_SIZE;
+	cq_off = PAGE_ALIGN(sq_off + sq * sizeof(struct waitq_sqe));
+	size = PAGE_ALIGN(cq_off + cq * sizeof(struct waitq_cqe));
+
+	mutex_lock(&ctx->ring_mtx);
+	if (wf->rings) {
+		mutex_unlock(&ctx->ring_mtx);
+		return -EBUSY;
+	}
+
+	r = vmalloc_user(size);
+	if (!r) {
+		mutex_unlock(&ctx->ring_mtx);
+		return -ENOMEM;
+	}
+	r->sq_entries = sq;
+	r->cq_entries = cq;
+	r->sq_off = sq_off;
+	r->cq_off = cq_off;
+	// the workers may be asleep already
+	r->flags = WAITQ_SQ_NEED_WAKEUP;
+
+	wf->sqes = (void *)r + sq_off;
+	wf->cqes = (void *)r + cq_off;
+	wf->sq_mask = sq - 1;
+	wf->cq_mask = cq - 1;
+
+	spin_lock(&wf->cq_lock);
+	wf->rings = r;
+	spin_unlock(&wf->cq_lock);
+
+	list_add_tail(&wf->ring_node, &ctx->rings);
+	mutex_unlock(&ctx->ring_mtx);
+
+	p.sq_entries = sq;
+	p.cq_entries = cq;
+	p.size = size;
+
+	return copy_to_user(up, &p, sizeof(p)) ? -EFAULT : 0;
+}
+
+/*
+ * What a worker does with an identity. The handlers only simulate work,
+ * taking work_us either asleep, like a driver waiting for hardware, or
+ * spinning, like real computation.
+ */
+struct waitq_handler {
+	const char *name;
+	int (*fn)(struct identity *idnt, unsigned int cost_us);
+};
+
+static int handle_none(struct identity *idnt, unsigned int cost_us)
+{
+	return 0;
+}
+
+static int handle_sleep(struct identity *idnt, unsigned int cost_us)
+{
+	fsleep(cost_us);
+	return 0;
+}
+
+static int handle_spin(struct identity *idnt, unsigned int cost_us)
+{
+	u64 end = ktime_get_ns() + (u64)cost_us * NSEC_PER_USEC;
+
+	while (ktime_get_ns() < end)
+		cond_resched();
+	return 0;
+}
+
+static const struct waitq_handler waitq_handlers[] = {
+	{ "none", handle_none },
+	{ "sleep", handle_sleep },
+	{ "spin", handle_spin },
+};
+
+static const struct waitq_handler *handler = &waitq_handlers[1];
+
+static int handler_set(const char *val, const struct kernel_param *kp)
+{
+	for (int i = 0; i < ARRAY_SIZE(waitq_handlers); i++) {
+		if (sysfs_streq(val, waitq_handlers[i].name)) {
+			WRITE_ONCE(handler, &waitq_handlers[i]);
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static int handler_get(char *buf, const struct kernel_param *kp)
+{
+	return sysfs_emit(buf, "%s\n", READ_ONCE(handler)->name);
+}
+
+static const struct kernel_param_ops handler_ops = {
+	.set = handler_set,
+	.get = handler_get,
+};
+module_param_cb(handler, &handler_ops, NULL, 0644);
+MODULE_PARM_DESC(handler, "How an identity is handled: none, sleep or spin (default=sleep)");
+
+static unsigned int lat_bucket(u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	return us ? min_t(unsigned int, ilog2(us) + 1, NR_LAT - 1) : 0;
+}
+
+static void stats_account(const struct identity *idnt)
+{
+	this_cpu_inc(waitq_stats.completed);
+	if (idnt->deadline && idnt->t_done > idnt->deadline)
+		this_cpu_inc(waitq_stats.missed);
+	this_cpu_inc(waitq_stats.lat[LAT_QUEUE][lat_bucket(idnt->t_deq - idnt->t_enq)]);
+	this_cpu_inc(waitq_stats.lat[LAT_SERVICE][lat_bucket(idnt->t_done - idnt->t_deq)]);
+	this_cpu_inc(waitq_stats.lat[LAT_TOTAL][lat_bucket(idnt->t_done - idnt->t_enq)]);
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct waitq_stats *sum;
+	unsigned int cpu;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		const struct waitq_stats *st = per_cpu_ptr(&waitq_stats, cpu);
+
+		sum->submitted += st->submitted;
+		sum->completed += st->completed;
+		sum->missed += st->missed;
+		sum->local += st->local;
+		sum->stolen += st->stolen;
+		for (int s = 0; s < NR_STAGES; s++)
+			for (int b = 0; b < NR_LAT; b++)
+				sum->lat[s][b] += st->lat[s][b];
+	}
+
+	seq_printf(m, "submitted\t%llu\n", sum->submitted);
+	seq_printf(m, "completed\t%llu\n", sum->completed);
+	seq_printf(m, "missed\t\t%llu\n", sum->missed);
+	seq_printf(m, "local\t\t%llu\n", sum->local);
+	seq_printf(m, "stolen\t\t%llu\n", sum->stolen);
+	seq_printf(m, "depth\t\t%d\n", atomic_read(&ctx->depth));
+
+	seq_puts(m, "\nusec");
+	for (int s = 0; s < NR_STAGES; s++)
+		seq_printf(m, "\t%s", lat_stage[s]);
+	seq_putc(m, '\n');
+
+	for (int b = 0; b < NR_LAT; b++) {
+		if (!sum->lat[LAT_TOTAL][b] && !sum->lat[LAT_QUEUE][b] && !sum->lat[LAT_SERVICE][b])
+			continue;
+		seq_printf(m, "%llu", b ? 1ULL << (b - 1) : 0);
+		for (int s = 0; s < NR_STAGES; s++)
+			seq_printf(m, "\t%llu", sum->lat[s][b]);
+		seq_putc(m, '\n');
+	}
+
+	seq_puts(m, "\ncpu\tlocal\tstolen\n");
+	for_each_possible_cpu(cpu) {
+		const struct waitq_stats *st = per_cpu_ptr(&waitq_stats, cpu);
+
+		if (st->local || st->stolen)
+			seq_printf(m, "%u\t%llu\t%llu\n", cpu, st->local, st->stolen);
+	}
+
+	kfree(sum);
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_show, NULL);
+}
+
+/* Any write starts the counters and histograms over. */
+static ssize_t stats_write(struct file *file, const char __user *ubuf,
+			   size_t count, loff_t *off)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&waitq_stats, cpu), 0, sizeof(struct waitq_stats));
+
+	return count;
+}
+
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.write = stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int wee_kthread(void *data)
 {
+	unsigned int cpu = (unsigned long)data;
+	struct waitq_cpu *q = per_cpu_ptr(&waitq_cpu, cpu);
+
 	while (!kthread_should_stop()) {
-		/* Sleep until data becomes ready or stop thread. */
-		wait_event_interruptible(ctx->wee_wait, kthread_should_stop() || atomic_read(&ctx->data_ready) != 0);
+		struct identity *idnt;
+		int status;
+
+		idnt = waitq_next(cpu);
+		if (!idnt) {
+			/*
+			 * Sleep until data becomes ready or stop thread. Say so
+			 * first, then look again: a submission either is seen
+			 * here or sees us idle and kicks us. Exclusive, so a
+			 * single write wakes a single worker.
+			 */
+			if (atomic_inc_return(&q->idle) == 1)
+				cpumask_set_cpu(cpu, &ctx->idle_cpus);
+			if (atomic_inc_return(&ctx->idle) >= READ_ONCE(ctx->nr_workers))
+				rings_harvest(true);
+
+			idnt = waitq_next(cpu);
+			if (!idnt) {
+				wait_event_interruptible_exclusive(q->wait, kthread_should_stop() ||
+								   sched_pending(q) || READ_ONCE(q->kick));
+				// a kick is for whoever wakes up to it, once
+				xchg(&q->kick, false);
+			}
+
+			atomic_dec(&ctx->idle);
+			if (atomic_dec_return(&q->idle) == 0)
+				cpumask_clear_cpu(cpu, &ctx->idle_cpus);
+
+			if (!idnt)
+				continue;
+		}
+
+		dev_dbg(ctx->dev, "got identity: %s number %d\n", idnt->name, idnt->id);
+
+		idnt->t_deq = ktime_get_ns();
+		status = READ_ONCE(handler)->fn(idnt, READ_ONCE(work_us));
+		idnt->t_done = ktime_get_ns();
+
+		stats_account(idnt);
+		identity_complete(idnt, status, idnt->t_done - idnt->t_deq);
+
+		identity_free(idnt);
+		depth_put();
+
+		/* No need for a doorbell while we are busy. */
+		rings_harvest(false);
+	}
+
+	if (kthread_should_stop())
+		dev_dbg(ctx->dev, "kthread_should_stop()\n");
+
+	return 0;
+}
+
+static void workers_stop_cpu(unsigned int cpu, unsigned int n)
+{
+	struct waitq_cpu *q = per_cpu_ptr(&waitq_cpu, cpu);
+
+	for (unsigned int i = 0; i < n; i++)
+		kthread_stop(q->workers[i]);
+	WRITE_ONCE(ctx->nr_workers, ctx->nr_workers - n);
+	kfree(q->workers);
+	q->workers = NULL;
+}
+
+/* A CPU came online: start the workers bound to it. */
+static int waitq_cpu_online(unsigned int cpu)
+{
+	struct waitq_cpu *q = per_cpu_ptr(&waitq_cpu, cpu);
+	unsigned int per_cpu = max(workers, 1U);
+
+	q->workers = kcalloc(per_cpu, sizeof(*q->workers), GFP_KERNEL);
+	if (!q->workers)
+		return -ENOMEM;
+
+	for (unsigned int i = 0; i < per_cpu; i++) {
+		struct task_struct *t;
+
+		t = kthread_create_on_cpu(wee_kthread, (void *)(unsigned long)cpu,
+					  cpu, "waitq/%u");
+		if (IS_ERR(t)) {
+			dev_warn(ctx->dev, "Failed to create kthread\n");
+			workers_stop_cpu(cpu, i);
+			return PTR_ERR(t);
+		}
+		q->workers[i] = t;
+		WRITE_ONCE(ctx->nr_workers, ctx->nr_workers + 1);
+		wake_up_process(t);
+	}
+
+	return 0;
+}
+
+/*
+ * A CPU is going down: stop its workers before they are left bound to a
+ * dead CPU. What is still queued there, or is submitted there before it
+ * is gone, is taken by the other CPUs' workers; kick one, which also has
+ * the last of them to go idle set NEED_WAKEUP again.
+ */
+static int waitq_cpu_offline(unsigned int cpu)
+{
+	struct waitq_cpu *q = per_cpu_ptr(&waitq_cpu, cpu);
+
+	workers_stop_cpu(cpu, max(workers, 1U));
+	waitq_kick(q);
+
+	return 0;
+}
 
-		if (kthread_should_stop()) {
-			dev_dbg(ctx->dev, "kthread_should_stop()\n");
+static void workers_stop(void)
+{
+	cpuhp_remove_state(ctx->hp_state);
+}
+
+/*
+ * Workers are bound, each to the CPU whose queue it serves, and follow
+ * CPUs as they come and go.
+ */
+static int workers_start(void)
+{
+	int ret;
+
+	ret = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "waitq:online",
+				waitq_cpu_online, waitq_cpu_offline);
+	if (ret < 0)
+		return ret;
+	ctx->hp_state = ret;
+
+	dev_info(ctx->dev, "%u workers started\n", READ_ONCE(ctx->nr_workers));
+
+	return 0;
+}
+
+/* Drop the rest of an overlong name, up to and including its newline. */
+static bool skip_line(struct iov_iter *from)
+{
+	char buf[32];
+
+	while (iov_iter_count(from)) {
+		size_t want = min(sizeof(buf), iov_iter_count(from));
+		char *nl;
+
+		if (copy_from_iter(buf, want, from) != want)
+			return false;
+
+		nl = memchr(buf, '\n', want);
+		if (nl) {
+			iov_iter_revert(from, want - (nl - buf) - 1);
 			break;
 		}
+	}
 
-		if (likely(atomic_read(&ctx->data_ready) != 0)) {
-			atomic_dec(&ctx->data_ready);
-			
-			dev_dbg(ctx->dev, "kthread woke up, data is ready\n");
+	return true;
+}
 
-			struct identity *idnt = identity_get();
-			if (unlikely(!idnt)) {
-				dev_dbg(ctx->dev, "list was empty, should not happen\n");
-				continue;
+/*
+ * A write carries any number of names, one per line, the last newline
+ * optional. Each name is copied from userspace straight into its slab
+ * object, at most NAME_LEN - 1 bytes of it, and the whole write is queued
+ * in one go. Returns the bytes up to the last complete name when it runs
+ * out of memory or hits a bad buffer halfway.
+ *
+ * With max_depth submissions pending, what is written so far is queued
+ * and the writer waits for room, or stops there if it is non-blocking.
+ */
+static ssize_t write_miscdev(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct waitq_file *wf = iocb->ki_filp->private_data;
+	bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	struct llist_node *first = NULL, *last = NULL;
+	size_t total = iov_iter_count(from), done = 0;
+	struct identity *idnt;
+	ssize_t ret = 0;
+
+	while (iov_iter_count(from)) {
+		size_t want = min_t(size_t, NAME_LEN - 1, iov_iter_count(from));
+		size_t len;
+		char *nl;
+
+		if (!depth_get()) {
+			if (first) {
+				identity_submit(first, last);
+				first = last = NULL;
 			}
-			dev_dbg(ctx->dev, "got identity: %s number %d\n", idnt->name, idnt->id);
+			if (nonblock) {
+				ret = -EAGAIN;
+				break;
+			}
+			if (wait_event_interruptible(ctx->space_wait, !depth_full())) {
+				ret = -ERESTARTSYS;
+				break;
+			}
+			continue;
+		}
 
-			/* sleep */
-			ssleep(2);
+		idnt = identity_alloc("", 0);
+		if (unlikely(!idnt)) {
+			depth_put();
+			ret = -ENOMEM;
+			break;
+		}
 
+		len = copy_from_iter(idnt->name, want, from);
+		if (len != want) {
+			dev_warn(ctx->dev, "copy_from_iter() failed, returning\n");
 			kmem_cache_free(ctx->mem_cache, idnt);
-		} else {
-			dev_dbg(ctx->dev, "kthread woke up, DATA NOT READY, INTERRUPT\n");
+			depth_put();
+			ret = -EFAULT;
+			break;
+		}
+
+		nl = memchr(idnt->name, '\n', len);
+		if (nl) {
+			// give back what belongs to the next name
+			iov_iter_revert(from, len - (nl - idnt->name) - 1);
+			len = nl - idnt->name;
+		} else if (len == NAME_LEN - 1 && iov_iter_count(from)) {
+			bool ok;
+			char c;
+
+			// a name of exactly the maximum length may end right here
+			ok = copy_from_iter(&c, 1, from) == 1;
+			if (ok && c != '\n') {
+				dev_warn_ratelimited(ctx->dev, "Name exceeds max allowed 19 chars! Shrinking.\n");
+				ok = skip_line(from);
+			}
+			if (!ok) {
+				kmem_cache_free(ctx->mem_cache, idnt);
+				depth_put();
+				ret = -EFAULT;
+				break;
+			}
+		}
+		idnt->name[len] = '\0';
+		done = total - iov_iter_count(from);
+
+		if (!len) {
+			kmem_cache_free(ctx->mem_cache, idnt);
+			depth_put();
+			continue;
 		}
+		idnt->id = atomic_fetch_add(1, &ctx->cnt);
+		idnt->prio = READ_ONCE(wf->prio);
+		idnt->deadline_us = READ_ONCE(wf->deadline_us);
+		idnt->owner = wf;
+		kref_get(&wf->ref);
+
+		idnt->node.next = NULL;
+		if (last)
+			last->next = &idnt->node;
+		else
+			first = &idnt->node;
+		last = &idnt->node;
 	}
 
-	return 0;
+	/* Hand them to the workers. */
+	if (first)
+		identity_submit(first, last);
+
+	return done ?: ret;
 }
 
-static ssize_t write_miscdev(struct file *filp, const char __user *ubuf,
+/*
+ * Hands out whole completion records, as many as fit in count. Blocks while
+ * there are none unless the file is non-blocking.
+ */
+static ssize_t read_miscdev(struct file *filp, char __user *ubuf,
 				size_t count, loff_t *off)
 {
-	ssize_t ret = count;
-	void *kbuf; 
+	struct waitq_file *wf = filp->private_data;
+	unsigned int copied;
+	int ret;
+
+	if (count < sizeof(struct waitq_cqe))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&wf->read_mtx))
+		return -ERESTARTSYS;
+
+	while (kfifo_is_empty(&wf->cq)) {
+		mutex_unlock(&wf->read_mtx);
 
-	if (count >= NAME_LEN) {
-		dev_warn(ctx->dev, "Name exceeds max allowed 19 chars! Shrinking.\n");
-		count = NAME_LEN - 1;
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(wf->wait, !kfifo_is_empty(&wf->cq)))
+			return -ERESTARTSYS;
+
+		if (mutex_lock_interruptible(&wf->read_mtx))
+			return -ERESTARTSYS;
 	}
 
-	kbuf = kvzalloc(count + 1, GFP_KERNEL);
+	ret = kfifo_to_user(&wf->cq, ubuf, count, &copied);
+	mutex_unlock(&wf->read_mtx);
 
-	if (copy_from_user(kbuf, ubuf, count)) {
-		dev_warn(ctx->dev, "copy_from_user() failed, returning\n");
-		kvfree(kbuf);
-		return -EFAULT;
+	return ret ?: copied;
+}
+
+static __poll_t poll_miscdev(struct file *filp, poll_table *wait)
+{
+	struct waitq_file *wf = filp->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &wf->wait, wait);
+	poll_wait(filp, &ctx->space_wait, wait);
+
+	if (!depth_full())
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	if (!kfifo_is_empty(&wf->cq))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (wf->rings && READ_ONCE(wf->rings->cq_tail) != READ_ONCE(wf->rings->cq_head))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	return mask;
+}
+
+static long ioctl_miscdev(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct waitq_file *wf = filp->private_data;
+	struct waitq_class cls;
+	long ret;
+
+	switch (cmd) {
+	case WAITQ_IOC_SETUP:
+		return ring_setup(wf, (void __user *)arg);
+	case WAITQ_IOC_ENTER:
+		if (!READ_ONCE(wf->rings))
+			return -EINVAL;
+		mutex_lock(&wf->sq_mtx);
+		ret = ring_harvest(wf);
+		mutex_unlock(&wf->sq_mtx);
+		return ret;
+	case WAITQ_IOC_SET_CLASS:
+		if (copy_from_user(&cls, (void __user *)arg, sizeof(cls)))
+			return -EFAULT;
+		if (cls.prio >= WAITQ_NR_PRIO)
+			return -EINVAL;
+		WRITE_ONCE(wf->prio, cls.prio);
+		WRITE_ONCE(wf->deadline_us, cls.deadline_us);
+		return 0;
+	default:
+		return -ENOTTY;
 	}
+}
 
-	/* Add to tail of the list. */
-	identity_create(kbuf, atomic_fetch_add(1, &ctx->cnt));
+static int mmap_miscdev(struct file *filp, struct vm_area_struct *vma)
+{
+	struct waitq_file *wf = filp->private_data;
 
-	/* Wake up the wait queue. */
-	atomic_inc(&ctx->data_ready);
-	wake_up_interruptible(&ctx->wee_wait);
+	if (!READ_ONCE(wf->rings))
+		return -EINVAL;
+	if (vma->vm_flags & VM_EXEC)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYEXEC);
 
-	return ret;
+	return remap_vmalloc_range(vma, wf->rings, vma->vm_pgoff);
 }
 
 static int open_miscdev(struct inode *inode, struct file *filp)
 {
+	struct waitq_file *wf;
+
+	wf = kzalloc(sizeof(*wf), GFP_KERNEL);
+	if (!wf)
+		return -ENOMEM;
+
+	if (kfifo_alloc(&wf->cq, clamp(READ_ONCE(cq_entries), 2U, 1U << 16), GFP_KERNEL)) {
+		kfree(wf);
+		return -ENOMEM;
+	}
+	kref_init(&wf->ref);
+	spin_lock_init(&wf->cq_lock);
+	mutex_init(&wf->read_mtx);
+	mutex_init(&wf->sq_mtx);
+	INIT_LIST_HEAD(&wf->ring_node);
+	init_waitqueue_head(&wf->wait);
+	wf->prio = WAITQ_PRIO_DEFAULT;
+	filp->private_data = wf;
+
 	return nonseekable_open(inode, filp);
 }
 
 static int close_miscdev(struct inode *inode, struct file *filp)
 {
+	struct waitq_file *wf = filp->private_data;
+
+	if (wf->rings) {
+		mutex_lock(&ctx->ring_mtx);
+		list_del(&wf->ring_node);
+		mutex_unlock(&ctx->ring_mtx);
+	}
+
+	kref_put(&wf->ref, waitq_file_free);
 	return 0;
 }
 
 static const struct file_operations llkd_misc_fops = {
 	.owner = THIS_MODULE,
 	.open = open_miscdev,
-	.write = write_miscdev,
+	.read = read_miscdev,
+	.write_iter = write_miscdev,
+	.poll = poll_miscdev,
+	.unlocked_ioctl = ioctl_miscdev,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = mmap_miscdev,
 	.release = close_miscdev,
 	.llseek = no_llseek
 };
@@ -200,7 +1280,7 @@ static const struct file_operations llkd_misc_fops = {
 static struct miscdevice llkd_miscdev = {
 	.minor = MISC_DYNAMIC_MINOR,
 	.name = "eudyptula",
-	.mode = 0444,
+	.mode = 0660,		/* producers: root, or a group set by udev */
 	.fops = &llkd_misc_fops
 };
 
@@ -214,10 +1294,12 @@ static void insert_test_data(void)
 	identity_create("Gena", atomic_fetch_add(1, &ctx->cnt));
 
 	temp = identity_find(3);
-	if (unlikely(temp == NULL))
+	if (unlikely(temp == NULL)) {
 		pr_debug("id 3 not found\n");
-	else
+	} else {
 		pr_debug("id 3 = %s\n", temp->name);
+		identity_put(temp);
+	}
 
 	temp = identity_find(42);
 	if (likely(temp == NULL))
@@ -227,14 +1309,17 @@ static void insert_test_data(void)
 	identity_destroy(2);
 
 	temp = identity_find(2);
-	if (likely(temp == NULL))
+	if (likely(temp == NULL)) {
 		pr_debug("id 2 not found\n");
-	else
+	} else {
 		pr_debug("id 2 = %s\n", temp->name);
+		identity_put(temp);
+	}
 }
 
 static int __init waitq_init(void)
 {
+	unsigned int cpu;
 	int ret = misc_register(&llkd_miscdev);
 	if (ret) {
 		pr_notice("misc device registration failed\n");
@@ -243,14 +1328,28 @@ static int __init waitq_init(void)
 
 	/* Initialize driver context. */
 	ctx = devm_kzalloc(llkd_miscdev.this_device, sizeof(struct drv_ctx), GFP_KERNEL);
-	if (!ctx)
-		return -ENOMEM;
+	if (!ctx) {
+		ret = -ENOMEM;
+		goto out_misc;
+	}
 	ctx->dev = llkd_miscdev.this_device;
 	INIT_LIST_HEAD(&ctx->head_node);
-	init_waitqueue_head(&ctx->wee_wait);
 	mutex_init(&ctx->list_mtx);
+	for_each_possible_cpu(cpu) {
+		struct waitq_cpu *q = per_cpu_ptr(&waitq_cpu, cpu);
+
+		init_llist_head(&q->subq);
+		spin_lock_init(&q->sched.lock);
+		for (int p = 0; p < WAITQ_NR_PRIO; p++) {
+			q->sched.prio[p].deadline = RB_ROOT_CACHED;
+			INIT_LIST_HEAD(&q->sched.prio[p].fifo);
+		}
+		init_waitqueue_head(&q->wait);
+	}
+	INIT_LIST_HEAD(&ctx->rings);
+	mutex_init(&ctx->ring_mtx);
+	init_waitqueue_head(&ctx->space_wait);
 	atomic_set(&ctx->cnt, 1);
-	atomic_set(&ctx->data_ready, 0);
 
 	dev_info(ctx->dev, "LLKD misc driver (major #10, minor #%d) registered,"
 		" dev node is /dev/%s\n", llkd_miscdev.minor, llkd_miscdev.name);
@@ -261,37 +1360,70 @@ static int __init waitq_init(void)
 					sizeof(long),		  // 0 or sizeof(long) to align to size of word
 					SLAB_HWCACHE_ALIGN,	  // good for performance
 					NULL);
-	if (!ctx->mem_cache)
-		return -ENOMEM;
-
-	/* Create kernel thread for wait queue. */
-	ctx->waitq_task = kthread_run(wee_kthread, NULL, "waitq_task");
-	if (IS_ERR(wee_kthread)) {
-		dev_warn(ctx->dev, "Failed to create kthread\n");
-		return PTR_ERR(wee_kthread);
+	if (!ctx->mem_cache) {
+		ret = -ENOMEM;
+		goto out_misc;
 	}
 
+	ret = rhashtable_init(&ctx->id_index, &id_params);
+	if (ret)
+		goto out_cache;
+
+	/* Create the consumer threads for the wait queue. */
+	ret = workers_start();
+	if (ret)
+		goto out_index;
+
+	/* Queue depth; write 0 to high_water to start over. */
+	ctx->dbg = debugfs_create_dir("waitq", NULL);
+	debugfs_create_atomic_t("depth", 0444, ctx->dbg, &ctx->depth);
+	debugfs_create_u32("high_water", 0644, ctx->dbg, &ctx->high_water);
+	debugfs_create_file("stats", 0644, ctx->dbg, NULL, &stats_fops);
 
 	/* Test data. */
 	insert_test_data();
 
 	return 0;
+
+out_index:
+	rhashtable_destroy(&ctx->id_index);
+out_cache:
+	kmem_cache_destroy(ctx->mem_cache);
+out_misc:
+	misc_deregister(&llkd_miscdev);
+	return ret;
 }
 
 static void __exit waitq_exit(void)
 {
+	struct identity *curr;
+	unsigned int cpu;
+
+	debugfs_remove_recursive(ctx->dbg);
+
 	list_destroy();
+	rhashtable_destroy(&ctx->id_index);
 
 	if (likely(list_empty(&ctx->head_node)))
 		dev_info(ctx->dev, "list is empty now\n");
 	else
 		dev_info(ctx->dev, "list is left NON-empty\n");
 
-	if (ctx->waitq_task)
-		kthread_stop(ctx->waitq_task);
+	workers_stop();
 
 	pr_info("kthread_stop() called\n");
 
+	/* Whatever was written after the workers stopped. */
+	for_each_possible_cpu(cpu) {
+		struct waitq_cpu *q = per_cpu_ptr(&waitq_cpu, cpu);
+
+		sched_pull(q);
+		while ((curr = sched_pop(q)))
+			identity_free(curr);
+	}
+
+	/* Frees still waiting for a grace period. */
+	rcu_barrier();
 	kmem_cache_destroy(ctx->mem_cache);
 
 	pr_info("kmem_cache_destroy() called\n");
@@ -0,0 +1,97 @@
+#ifndef __WAITQ_H__
+#define __WAITQ_H__
+
+/*
+ * What read() on /dev/eudyptula returns: one record per name written
+ * through the same open file, in the order the workers finished them.
+ * Included by the module and by userspace alike.
+ *
+ * The device is created 0660, owned by root:root. To let other users
+ * submit, give it a producers' group with a udev rule, e.g.
+ *
+ *   KERNEL=="eudyptula", GROUP="waitq"
+ *
+ * Names can also be submitted without a syscall each. WAITQ_IOC_SETUP
+ * sizes a pair of rings for the open file and returns the size to mmap().
+ * The mapping starts with struct waitq_rings; the submission ring of
+ * struct waitq_sqe is at sq_off, the completion ring of struct waitq_cqe
+ * at cq_off. Indexes run freely, entry n is at n & (entries - 1).
+ *
+ * Userspace fills the sqe at sq_tail, then moves sq_tail on; the workers
+ * pick them up between items while they are busy. Once they have all gone
+ * idle they set WAITQ_SQ_NEED_WAKEUP, and userspace, after moving sq_tail
+ * and a full barrier, checks it and calls WAITQ_IOC_ENTER if set. From
+ * setup on, completions go to the completion ring rather than to read():
+ * the kernel fills the cqe at cq_tail, userspace consumes up to it and
+ * moves cq_head on. poll() reports EPOLLIN while it is not empty.
+ *
+ * Submissions are handled by class, 0 first; within a class, earliest
+ * deadline first, then those without one in order. Names written with
+ * write() take the class and relative deadline last set with
+ * WAITQ_IOC_SET_CLASS on the file; an sqe may carry its own.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define WAITQ_NAME_LEN	20
+
+#define WAITQ_NR_PRIO		4
+#define WAITQ_PRIO_DEFAULT	1
+
+#define WAITQ_SQ_NEED_WAKEUP	(1U << 0)
+
+#define WAITQ_SQE_CLASS		(1U << 0)	/* prio and deadline_us are set */
+
+struct waitq_rings {
+	/* written by the kernel */
+	__u32 sq_head;
+	__u32 cq_tail;
+	__u32 flags;
+	__u32 cq_overflow;		/* completions lost to a full ring */
+	__u32 pad0[12];
+	/* written by userspace */
+	__u32 sq_tail;
+	__u32 cq_head;
+	__u32 pad1[14];
+	/* fixed at setup */
+	__u32 sq_entries;		/* powers of 2 */
+	__u32 cq_entries;
+	__u64 sq_off;
+	__u64 cq_off;
+};
+
+struct waitq_sqe {
+	char name[WAITQ_NAME_LEN];	/* empty ones are skipped */
+	__u8 flags;
+	__u8 prio;
+	__u16 pad0;
+	__u32 deadline_us;
+	__u32 pad1;
+};
+
+struct waitq_class {
+	__u32 prio;			/* below WAITQ_NR_PRIO */
+	__u32 deadline_us;		/* from submission, 0 for none */
+};
+
+struct waitq_ring_params {
+	__u32 sq_entries;		/* in: at most 65536, rounded up to a power of 2 */
+	__u32 cq_entries;
+	__u64 size;			/* out: of the mapping */
+};
+
+#define WAITQ_IOC_MAGIC		'w'
+#define WAITQ_IOC_SETUP		_IOWR(WAITQ_IOC_MAGIC, 1, struct waitq_ring_params)
+#define WAITQ_IOC_ENTER		_IO(WAITQ_IOC_MAGIC, 2)	/* returns the sqes taken */
+#define WAITQ_IOC_SET_CLASS	_IOW(WAITQ_IOC_MAGIC, 3, struct waitq_class)
+
+struct waitq_cqe {
+	__s32 id;
+	__s32 status;			/* 0, or a negative errno from the handler */
+	__u64 time_ns;			/* spent in the handler */
+	char name[WAITQ_NAME_LEN];	/* as written, NUL terminated */
+	__u32 pad;
+};
+
+#endif /* __WAITQ_H__ */